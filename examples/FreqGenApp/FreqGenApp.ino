@@ -278,7 +278,7 @@ void setup()
   delay(2000);  Lcd.clear();
 #endif 
 #if FREQGEN 
-  FG.set(1000000);
+  FG.apply(FrequencyGenerator::plan<1000000>());   // (solved at compile time)
 #endif
 #if FREQCTR 
   FC.mode(1);
@@ -0,0 +1,71 @@
+/******************************************************************************/
+/*                                                                            */
+/*         FreqGenRetune -- Frequency Generator Retune Timing Example         */
+/*                                                                            */
+/* This example is released under the same license as the library (see the    */
+/* LICENSE file).                                                             */
+/*                                                                            */
+/*  PROCESSOR:  ATmega32U4       COMPILER: Arduino/GNU C for AVR Vers 1.8.5   */ 
+/*                                                                            */
+/******************************************************************************/
+/*
+
+   This example measures how long 'FrequencyGenerator::apply' takes to write 
+   a plan to the hardware, to show what the register shadow (FGReg in the 
+   .cpp file) saves.  'apply' only writes the registers that change, so a 
+   change of count alone is just the OCR4C and OCR4A writes, while turning 
+   the output on writes all of them (as every 'set' used to).
+
+   The plans are solved first, so only 'apply' is timed.  Timer1 counts the
+   CPU clock around each call (so Timer1 can't be used for anything else 
+   here).  The results are printed on the USB serial port, e.g.:
+
+        all registers (output off -> on):  NNN cycles
+        count only (1000Hz -> 1001Hz):     NN cycles
+        clock change (1000Hz -> 300Hz):     NNN cycles
+
+   This module is not needed to use the frequency generator. 
+  
+*/
+
+#include "FrequencyGenerator.h" 
+FrequencyGenerator FG; 
+
+FrequencyGenerator::Plan P1000, P1001, P300; 
+
+unsigned TimeApply(const FrequencyGenerator::Plan &P)
+  // Apply 'P' and return the CPU cycles it took (less the timing overhead).
+{
+  unsigned t0,t; 
+  TCCR1A=0;  TCCR1B=0;  TCNT1=0;  TCCR1B=(1<<CS10);  // Timer1 at clk/1
+  t0=TCNT1;  t=TCNT1;  t-=t0;         // (the cost of reading it)
+  t0=TCNT1; 
+  FG.apply(P); 
+  return TCNT1-t0-t; 
+}
+
+void Report(const char *What, unsigned Cycles)
+{
+  Serial.print(What);  Serial.print(Cycles);  Serial.println(" cycles"); 
+}
+
+void setup() 
+{
+  Serial.begin(115200); 
+  while (!Serial) continue;         // (wait for the USB serial port)
+  P1000=FG.solve(1000);  P1001=FG.solve(1001);  P300=FG.solve(300); 
+}
+
+void loop() 
+{
+  unsigned all,cnt,ps; 
+  FG.set(0);                        // output off, so all are written
+  all=TimeApply(P1000); 
+  cnt=TimeApply(P1001);             // same clock and prescaler
+  ps=TimeApply(P300);               // PLL clock and prescaler change too
+  Report("all registers (output off -> on):  ",all); 
+  Report("count only (1000Hz -> 1001Hz):     ",cnt); 
+  Report("clock change (1000Hz -> 300Hz):     ",ps); 
+  Serial.println(); 
+  delay(5000); 
+}
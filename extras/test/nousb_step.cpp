@@ -0,0 +1,58 @@
+// nousb_step -- host test of 'reachable' and 'stepUp'/'stepDown' with 
+// FRQGENNOUSB.  Every frequency the timer can make from each of the 16 
+// clocks is listed by brute force and compared with what the stepper finds.
+// (See the Makefile)
+
+#include <stdio.h>
+#include <set>
+#include <utility>
+#include "FrequencyGenerator.h"
+
+// The NOUSB timer clocks in 4/3 MHz units (the ck column of FGClocks)
+static const byte CK[]={12,15,18,20,21,24,27,28,30,32,33,36,40,42,44,48}; 
+
+typedef std::pair<unsigned long long,unsigned long long> Ratio; 
+
+static unsigned long long gcd(unsigned long long a, unsigned long long b)
+{
+  while (b) { unsigned long long t=a%b;  a=b;  b=t; }
+  return a; 
+}
+
+static unsigned long brute(long Lo, long Hi)
+  // Count the exact frequencies (num/den Hz) that round into Lo..Hi
+{
+  std::set<Ratio> s;  unsigned long long num,den,g;  long f; 
+  for (unsigned c=0; c<sizeof(CK); c++)
+    for (unsigned lg=0; lg<15; lg++)
+      for (unsigned cnt=4; cnt<=0x3FF; cnt++)
+      {
+        num=CK[c]*4000000ULL;  den=(3ULL*cnt)<<lg; 
+        f=(long)((num*2/den+1)/2); 
+        if (f<Lo || f>Hi) continue; 
+        g=gcd(num,den);  s.insert(Ratio(num/g,den/g)); 
+      }
+  return s.size(); 
+}
+
+int main()
+{
+  static const long R[][2]={ {1,3},{123,130},{1000,1010},{50000,50500},
+    {1000000,1100000},{7000000,9000000} }; 
+  FrequencyGenerator FG;  unsigned long n,b;  long f,u;  int fail=0; 
+
+  for (unsigned i=0; i<sizeof(R)/sizeof(R[0]); i++)
+  {
+    n=FG.reachable(R[i][0],R[i][1],0);  b=brute(R[i][0],R[i][1]); 
+    printf("reachable(%ld,%ld)=%lu  expected %lu\n",R[i][0],R[i][1],n,b); 
+    if (n!=b) fail++; 
+  }
+  // A step up and back down returns to where it started
+  for (f=1000; f<=1010; f++)
+  {
+    FG.set(f);  u=FG.stepUp(); 
+    if (u<f || FG.stepDown()>u) { printf("step at %ld\n",f);  fail++; }
+  }
+  printf(fail ? "FAIL\n" : "PASS\n"); 
+  return fail!=0; 
+}
@@ -0,0 +1,82 @@
+// pps_replay -- host test of the GPS 1PPS filter ('ppsTimestamp', 
+// 'ppsUpdate' and 'ppsPpb') with FRQGENPPS.  Timestamps of a crystal with a
+// known error are replayed through the filter, starting just before the 32 
+// bit timestamps wrap: a steady error, a drifting one, a missed pulse and 
+// an extra pulse.  (See the Makefile)
+
+#include <stdio.h>
+#include "FrequencyGenerator.h"
+
+static FrequencyGenerator FG; 
+static uint32_t T;                  // Timestamp (crystal clocks, wraps)
+static double Frac;                 //   and its fraction of a clock
+static int Fail; 
+
+static void second(double Ppb)
+  // Replay one second of a crystal 'Ppb' fast, with a little jitter.
+{
+  static unsigned r=1; 
+  double c=F_CPU*(1.0+Ppb*1e-9)+Frac; 
+  r=r*1103515245+12345; 
+  T+=(uint32_t)c+((r>>16)&1);  Frac=c-(uint32_t)c; 
+  FrequencyGenerator::ppsTimestamp(T); 
+}
+
+static void check(const char *What, byte State, long Ppb, long Tol)
+{
+  byte s=FG.ppsUpdate();  long p=FG.ppsPpb(); 
+  bool ok=(s==State && p-Ppb<=Tol && Ppb-p<=Tol); 
+  printf("%-28s state %d ppb %6ld  (expected %d, %ld +/-%ld)%s\n",
+         What,s,p,State,Ppb,Tol,ok ? "" : "  FAIL"); 
+  if (!ok) Fail++; 
+}
+
+static void start()
+  // Restart the filter, the timestamps 30 seconds before they wrap
+{
+  FG.pps(false);  FG.pps(true); 
+  T=0xFFFFFFFFUL-30UL*F_CPU;  Frac=0; 
+  FrequencyGenerator::ppsTimestamp(T); 
+}
+
+int main()
+{
+  int i; 
+
+  // Steady 20ppm: averaging at first, locked after 64 seconds (across the 
+  // wrap of the timestamps at 30 seconds)
+  start(); 
+  for (i=0; i<10; i++) second(20000); 
+  check("steady, 10s",1,20000,200); 
+  for (i=0; i<100; i++) second(20000); 
+  check("steady, 110s",2,20000,100); 
+
+  // Drifting 1ppb a second: follows with the lag of the average
+  start(); 
+  for (i=0; i<300; i++) second(-5000+i); 
+  check("drifting, 300s",2,-5000+300-64,120); 
+
+  // A missed pulse (a 2 second gap) restarts the average but keeps the 
+  // estimate, then it locks again
+  start(); 
+  for (i=0; i<100; i++) second(3000); 
+  T+=F_CPU;  second(3000); 
+  check("missed pulse",0,3000,100); 
+  second(3000); 
+  check("missed pulse, 1s after",1,3000,100); 
+  for (i=0; i<70; i++) second(3000); 
+  check("missed pulse, 70s after",2,3000,100); 
+
+  // An extra pulse part way through a second restarts it twice
+  start(); 
+  for (i=0; i<100; i++) second(-8000); 
+  FrequencyGenerator::ppsTimestamp(T+F_CPU/3);  second(-8000); 
+  check("extra pulse",0,-8000,100); 
+  second(-8000); 
+  check("extra pulse, 1s after",1,-8000,100); 
+  for (i=0; i<70; i++) second(-8000); 
+  check("extra pulse, 70s after",2,-8000,100); 
+
+  printf(Fail ? "FAIL\n" : "PASS\n"); 
+  return Fail!=0; 
+}
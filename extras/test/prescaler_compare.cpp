@@ -0,0 +1,76 @@
+// prescaler_compare -- host comparison of the divisor search with the 
+// original one (a single prescaler from the log2 of CK/Freq/1024 for each 
+// clock) for every whole frequency from 1Hz to 16MHz in the normal (not 
+// hiRes) mode.  No frequency may get worse, and one with the same error must
+// keep the same divisors.  (See the Makefile)
+
+#include <stdio.h>
+#include <math.h>
+#include "FrequencyGenerator.h"
+
+static const byte CKM[]={1,6,4,3};  // Clock pll multipliers (16,96,64,48 Mhz)
+
+static double ppm(byte Pll, byte Lg, unsigned Cnt, long Freq)
+  // Error of the divisors in ppm
+{
+  double f=(double)F_CPU*CKM[Pll]/((double)(1UL<<Lg)*Cnt); 
+  return fabs(f-Freq)/Freq*1e6; 
+}
+
+static bool original(long Freq, double &Err, FrequencyGenerator::Plan &P)
+  // The original search (FrequencyGenerator::set of version 1.00), with its
+  // divisors in 'P'
+{
+  byte pll,lg,svPLL=0,svLG=0;  unsigned PS,cnt,svCNT=0;  long CK,CV,dif,svDIF=0x7FFFFFFFL; 
+  for (pll=0; pll<sizeof(CKM); pll++)
+  {
+    CK=F_CPU*CKM[pll];  CV=CK/Freq/1024; 
+    lg=0;  if (CV) { while (CV>1) { lg++;  CV>>=1; }  lg++; }
+    if (pll==1 || lg>14) continue; 
+    PS=1<<lg;  cnt=((CK*2/PS/Freq)+1)/2; 
+    if (cnt<4 || cnt>0x3FF) continue; 
+    dif=(CK-((long)PS*(long)cnt*Freq))/(long)CKM[pll];  if (dif<0) dif=-dif; 
+    if (dif<svDIF) { svPLL=pll;  svLG=lg;  svCNT=cnt;  svDIF=dif; }
+  }
+  if (svDIF==0x7FFFFFFFL) return false; 
+  Err=ppm(svPLL,svLG,svCNT,Freq); 
+  P.pll=svPLL;  P.lg=svLG;  P.cnt=svCNT; 
+  return true; 
+}
+
+int main()
+{
+  FrequencyGenerator FG;  FrequencyGenerator::Plan P,O; 
+  long f,better=0,worse=0,moved=0,none=0;  double e0,e1,sum0=0,sum1=0,most=0; 
+
+  for (f=1; f<=16000000L; f++)
+  {
+    P=FG.solve(f); 
+    if (!original(f,e0,O)) { if (P.freq<0L) none++;  continue; }
+    if (P.freq<0L) { worse++;  continue; }
+    e1=ppm(P.pll,P.lg,P.cnt,f); 
+    if (e1<e0-1e-9) 
+    { 
+      better++;  sum0+=e0;  sum1+=e1; 
+      if (e0-e1>most) most=e0-e1; 
+    }
+    else if (e1>e0+1e-9) 
+    {
+      if (worse<10) printf("%ld Hz worse: %.1f ppm -> %.1f ppm\n",f,e0,e1); 
+      worse++; 
+    }
+    else if (P.pll!=O.pll || P.lg!=O.lg || P.cnt!=O.cnt) 
+    {
+      if (moved<10) printf("%ld Hz tie moved: pll%d/lg%d/cnt%u -> pll%d/lg%d/cnt%u\n",
+                           f,O.pll,O.lg,O.cnt,P.pll,P.lg,P.cnt); 
+      moved++; 
+    }
+  }
+  printf("%ld frequencies improved, %ld got worse, %ld ties moved (%ld not possible)\n",
+         better,worse,moved,none); 
+  if (better) 
+    printf("mean error of those improved %.1f ppm -> %.1f ppm (most %.1f ppm less)\n",
+           sum0/better,sum1/better,most); 
+  printf(worse || moved ? "FAIL\n" : "PASS\n"); 
+  return worse || moved; 
+}
@@ -54,6 +54,104 @@
   The duty cycle of the output will be 50%.  The function returns either the 
   frequency being output or -1 if the new requested frequency could not be set.
  
+  'FrequencyGenerator::set' is made of two steps that may also be called 
+  separately.  'FrequencyGenerator::solve' does the divisor search and returns
+  a 'Plan' (PLL select, prescaler, count and output frequency) without 
+  touching the hardware, and 'FrequencyGenerator::apply' writes a plan to 
+  the registers.  An application that switches between a few frequencies can
+  solve each one once and then apply the saved plans, which only costs the 
+  register writes. 
+
+  'FrequencyGenerator::stepUp' and 'stepDown' move to the next higher or 
+  lower frequency the hardware can make, for tuning with buttons or an 
+  encoder.  For each clock and the prescalers around the current one they 
+  find the next count and keep the closest, comparing the frequencies by 
+  cross multiplying, so a step is a few shifts and multiplies (no search and
+  no divides) and never skips a frequency that can be made.
+
+  'FrequencyGenerator::reachable' lists every frequency that can be made 
+  between two limits (lowest first, each once) by stepping from the first 
+  one, so the time goes with the number listed.  With FRQGENHOST defined 
+  (on the compiler command line) the module builds on a PC without the 
+  Arduino headers or registers, so the solver can be used for test planning
+  there too.  (The tests in extras/test are built that way: run 'make' there)
+
+  'FrequencyGenerator::nearestExact' finds the closest frequency that comes
+  out exactly (no remainder), for gear that wants an exact whole number of 
+  Hertz.  The clocks only have factors of 2, 3 and 5, so it only looks at 
+  divisors made of those, a few dozen per clock.
+
+  For frequencies known when the sketch is built, the template
+  'FrequencyGenerator::plan<F>()' (in the .h file) does the same search as 
+  'solve' with constexpr functions, so the plan is worked out by the compiler
+  and 'apply' is all that runs.  A frequency that can't be made stops the 
+  build with a static_assert.
+
+  'FrequencyGenerator::lastResult' returns the details of the last solve: 
+  the PLL multiplier and select, timer clock, prescaler, OCR4C count, the 
+  exact output frequency as a fraction and the signed error in ppb.  The 
+  search only saves its plan and target, and the rest is worked out when 
+  asked for, so 'set' costs no more.
+
+  'FrequencyGenerator::hiRes' turns on a high resolution mode that uses the 
+  enhanced compare mode of Timer4 (ENHC4 in TCCR4E).  In that mode the counter
+  registers have an extra bit that selects a half count, so the count can be 
+  any number of half counts from 8 to 0x7FF.  This halves the frequency step 
+  between available frequencies, which matters most at high frequencies 
+  where the count is small (a count step of 1 is a large jump there).  
+  'FrequencyGenerator::read' returns the actual frequency in either mode.
+
+  'FrequencyGenerator::setMilliHz' is the same as 'set' but the frequency is
+  in milli-Hertz (up to 1MHz), and it returns the exact output frequency in 
+  mHz ('readMilliHz' also returns it).  The whole Hertz interface rounds the
+  output to the nearest Hertz, which hides an error of several percent at low
+  frequencies.  The divisors are solved against the fractional frequency by 
+  using the clock times 1000 (which needs a little more than a long, so the 
+  count routine takes it as clock/1024 and the low 10 bits) and the output in
+  mHz is worked out one decimal digit at a time, so no 64 bit divides are 
+  used.  The lowest frequency is still about 0.954Hz (16MHz/16384/1024).
+
+  The search keeps the best candidate for each clock (up to FRQGENTOPK) in 
+  order of error.  Usually several clocks make the same frequency with the 
+  same error, and 'FrequencyGenerator::policy' picks which of those ties is 
+  used: the first found (MinError), the biggest count (MaxCount), the 
+  slowest clock (LowestPll) or the clock now in use (KeepPll).  The pick is
+  one pass over the list, so no extra search is done.  'solveTop' returns 
+  the list.
+
+  'FrequencyGenerator::setPeriodNs' sets the output by its period in 
+  nanoseconds and 'readPeriodNs' returns it.  The period solver works in 
+  the time domain (it makes the period error smallest, which isn't quite the
+  same as the frequency error) and uses only multiplies to find the counts 
+  and prescalers.
+
+  If FRQGENDITHER is defined (below) the count can be dithered.  The timer 
+  can only make CK/(PS*cnt), so a frequency between two of those may be off 
+  by hundreds of ppm.  With dithering on ('FrequencyGenerator::dither', on by
+  default) 'solve' also works out the fraction of a count left over (in 
+  1/65536 counts) and the Timer4 overflow interrupt adds it to an accumulator 
+  every cycle, using a count one longer on the cycles where it carries.  The 
+  average frequency is then within a small fraction of a ppm of the one asked
+  for, though each cycle is one of the two nearest frequencies.  The fraction
+  is found once in 'solve', and the interrupt is only a 16 bit add and the 
+  OCR4C write.  Since it runs every cycle it is only used up to 
+  FRQGENDITHERMAX (F_CPU/256, 62.5KHz).
+
+  If FRQGENCACHE is defined (below) as a number of plans (4 to 8 is good) 
+  the most recent plans are kept, and a frequency that was solved recently 
+  (in the same mode) gets its plan from the cache with no search.  The least
+  recently used plan is dropped when the cache is full.  The hit and miss 
+  counts ('FrequencyGenerator::cacheStats') help choose the size.
+
+  If FRQGENNOUSB is defined (below) the PLL frequency is also searched.  
+  Normally the PLL must stay at 96MHz for USB, which leaves the timer with 
+  clocks of 16, 48 and 64MHz.  With FRQGENNOUSB the PLL may be set to any of 
+  40 to 96MHz (in 8MHz steps) and divided by 1, 1.5 or 2, giving 16 timer 
+  clocks from 16 to 64MHz.  The frequencies that can be made are much closer 
+  together (the average error is about 1/3 of what it is otherwise).  When 
+  the PLL frequency changes the timer waits for the PLL to lock before using 
+  it.  USB will NOT work in this mode, so use the UART (Serial1) instead.
+
   Since the timer is set up to automatically reload, no interrupts or other 
   software overhead is required -- Just call the function and then the 
   hardware will produce the output frequency with no additional intervention. 
@@ -80,6 +178,67 @@
   compensation value and then apply this compensation value to any value input 
   so that the actual output frequency is correct.
 
+  'FrequencyGenerator::calibrate' is that compensation.  It takes the crystal
+  error in ppb and works out the real clock once (as a clock unit in 1/256Hz
+  that every clock is a small multiple of), so the solver uses the real clock
+  with a few more multiplies and no divides.  The band table is for the 
+  nominal clock, so when calibrated the prescaler comes from the bit lengths
+  instead.  The value may be saved in EEPROM and is loaded at startup.
+
+  If FRQGENTEMPCOMP is defined (below) 'FrequencyGenerator::tempComp' adds a
+  correction for the crystal's temperature.  It is called from loop() and 
+  steps through an ADC reading of the internal temperature sensor without 
+  waiting (start, throw away the first conversion on the new reference, use
+  the second) once every FRQGENTEMPMS.  The reading is looked up in a table 
+  of points in EEPROM (straight lines between them) and if the correction 
+  has changed the frequency last set is solved again, and applied only if 
+  the divisors (or dither fraction) are different.  The ADC is left on the 
+  temperature sensor and the 2.56V reference (which drives AREF) between 
+  calls, so the sketch can't use analogRead() or an external AREF with it.
+
+  If FRQGENPPS is defined (below) as 1 or 3, Timer1 (or Timer3) counts the 
+  crystal and its input capture timestamps a GPS 1PPS signal.  The capture 
+  interrupt feeds 'FrequencyGenerator::ppsTimestamp', which averages the 
+  error of each second (the count less F_CPU) with only adds and shifts.  
+  'ppsUpdate' (from loop()) then uses the estimate as the clock correction,
+  as for 'calibrate', so the solver (and dithering) follow the GPS.  
+
+  If FRQGENSYNC is defined (below) 'FrequencyGenerator::apply' stages a new
+  plan for the Timer4 overflow interrupt instead of writing it mid cycle, 
+  which could make one short (or long) cycle.  At the start of a cycle the 
+  interrupt writes the compare values, which the timer loads together at the
+  end of it.  Only plans with the same PLL clock, prescaler and enhanced 
+  mode as the running one are staged: those registers act as soon as they 
+  are written, so a plan that changes them is written at once (and may make 
+  one odd cycle, as without FRQGENSYNC).  'pending' and 'wait' tell when the
+  new plan is being output.
+
+  'FrequencyGenerator::phase' sets what a frequency change does to the output
+  phase.  Normally the new count just takes over at the next TOP.  With 
+  PhaseContinuous the counter is stopped, scaled to the same fraction of the
+  new period and restarted, and with PhaseReset it restarts from 0 with the 
+  prescaler reset and the output at the start of a cycle.  The compare 
+  registers are written in the normal (not PWM) mode, as they are only 
+  buffered in the PWM modes, so all of the new plan is in at once.  PC6 
+  (OC4A-) is only connected to the timer in the PWM modes, so its level is 
+  read first and held by the PORT bit until the PWM mode is back.  
+
+  'FrequencyGenerator::mute' and 'unmute' key the output off and on without
+  stopping Timer4.  They just disconnect (and connect) the OC4x output, so the
+  pin is held low by its PORT bit meanwhile, and the output comes back in 
+  phase with the running timer.  
+
+  'FrequencyGenerator::setDuty' sets the duty cycle in 1/1000ths.  The part of
+  the cycle OC4x is high is worked out once (in 1/65536ths), so 'apply' finds
+  OCR4A (OCR4B) from the count with a multiply and a shift, and 'setDuty' on 
+  a running output only writes that register.  'setDutyResolution' makes the
+  policy pick (see 'solveTop') prefer a count of at least that many steps.
+
+  'FrequencyGenerator::apply' keeps a copy of the Timer4 and PLL registers 
+  it last wrote and only writes the ones that change, so a retune that keeps
+  the PLL and prescaler only writes the compare registers.  With FRQGENDEBUG
+  defined it prints the cycles (counted with Timer1) and the writes skipped.
+
   If it is desired to "trim" the Pro Micro's 16MHz oscillator to count or 
   generate frequencies that are more accurate, a Knowles Voltronics JR400 
   trimmer capacitor (8-40pF) (or similar) can be used to replace the C2 
@@ -106,182 +265,2046 @@
 Revision log: 
   1.00  2-5-21    REG   
     Initial implementation
+  1.10  10-16-26
+    Split 'set' into 'solve' (find divisors) and 'apply' (write registers)
+    around a 'Plan' so solved settings can be reused without re-solving.
+    Divisor search no longer calls the long divide routine in its loop and
+    uses a table of frequency bands to find the prescalers.
+    Optional high resolution mode using Timer4 enhanced compare (ENHC4).
+    Try the next prescaler up when the count rounds up past its limit.
+    Optional (FRQGENNOUSB) mode that also searches the PLL frequencies.
+    Added 'setMilliHz', 'solveMilliHz', 'milliHz' and 'readMilliHz' for 
+    frequencies in milli-Hertz.
+    Optional (FRQGENDITHER) dithering of the count for a more exact average
+    frequency.
+    Added the compile time 'plan<F>()'.
+    Optional (FRQGENCACHE) cache of recent plans.
+    Added 'stepUp' and 'stepDown'.
+    Added 'reachable' and the FRQGENHOST host (PC) build.
+    Added 'nearestExact'.
+    Added 'setPeriodNs', 'solvePeriodNs', 'periodNs' and 'readPeriodNs'.
+    Added 'lastResult'.
+    Added 'calibrate' and 'calibration' (crystal error, saved in EEPROM).
+    Optional (FRQGENTEMPCOMP) temperature compensation ('tempComp').
+    Optional (FRQGENPPS) GPS 1PPS disciplined mode ('pps', 'ppsUpdate').
+    Search keeps its best candidates ('solveTop') and a tie break 'policy'.
+    'apply' only writes the registers that change (FRQGENDEBUG shows cycles).
+    Optional (FRQGENSYNC) frequency changes at the end of a cycle ('sync', 
+    'pending' and 'wait').
+    Added 'phase' (keep the phase or restart it on a frequency change).
+    'apply' writes the registers with interrupts off; added 'applyFromISR'.
+    Added 'mute' and 'unmute'.
+    Added 'setDuty' and 'setDutyResolution' (duty cycle other than 50%).
 
 */
 
+#if FRQGENHOST
+// Host (PC) build: just the solver, for planning and tests.  (apply only 
+// records the plan)  Build with -DFRQGENHOST=1 and F_CPU defined (16MHz if not)
+#include <stdio.h>
+#define PROGMEM
+#define PSTR(s)               (s)
+#define printf_P              printf
+#define pgm_read_byte(p)      (*(p))
+#define pgm_read_word(p)      (*(p))
+#define pgm_read_dword(p)     (*(p))
+#else
 #include <Arduino.h>
+#include <avr/eeprom.h>
+#endif
 #include "FrequencyGenerator.h"
 
 //#define FRQGENUSEPB6  1       // Define to use  PB6 (Arduino pin 10)(using OC4B) instead
 //#define FRQGENDEBUG   1       // For debug... show counter values. 
+//#define FRQGENNOUSB   1       // Define to also search PLL frequencies (USB won't work)
+//#define FRQGENDITHER  1       // Define to dither the count (uses Timer4 overflow interrupt)
+//#define FRQGENCACHE   4       // Define as number of recent plans to keep (0 = none)
+//#define FRQGENTEMPCOMP 1      // Define to correct for temperature (see 'tempComp')
+//#define FRQGENPPS     1       // Define as 1 (ICP1, pin 4) or 3 (ICP3, pin 13) for GPS 1PPS
+//#define FRQGENSYNC    1       // Define to change frequency at the end of a cycle (see 'sync')
+
+#ifndef FRQGENDITHERMAX
+#define FRQGENDITHERMAX (F_CPU/256)     // Highest output frequency to dither (Hz)
+#endif
+#ifndef FRQGENSYNCMAX
+#define FRQGENSYNCMAX (F_CPU/256)       // Highest output frequency to change in sync (Hz)
+#endif
+#ifndef FRQGENEEADDR
+#define FRQGENEEADDR  (E2END-4)         // EEPROM address of the calibration (5 bytes)
+#endif
+#define FRQGENEESIG   0xC5              // (marks a calibration saved in EEPROM)
+#define FRQGENCALMAX  20000000L         // Largest calibration (ppb, 2%)
+#ifndef FRQGENTOPK
+#define FRQGENTOPK    3                 // Candidates the search keeps (see 'solveTop')
+#endif
+#define FGPOLALL      0x80              // (search policy for 'solveTop')
+#ifndef FRQGENTEMPMS
+#define FRQGENTEMPMS  1000              // Time between temperature readings (ms)
+#endif
+#define FRQGENTCPOINTS 8                // Most points in the temperature table
+#ifndef FRQGENTCADDR                    // EEPROM address of the temperature table
+#define FRQGENTCADDR  (FRQGENEEADDR-1-6*FRQGENTCPOINTS)
+#endif
+#define FRQGENTCMUX   ((1<<REFS1)|(1<<REFS0)|0x07)  // 2.56V ref, temperature (with MUX5)
+#ifndef FRQGENPPSAVG
+#define FRQGENPPSAVG  6                 // PPS average over 2^FRQGENPPSAVG seconds
+#endif
+#ifndef FRQGENPPSSTEP
+#define FRQGENPPSSTEP 10                // Re-solve when the PPS estimate moves (ppb)
+#endif
+#define FRQGENPPSMAXE (F_CPU/10000)     // Largest second error (counts, 100ppm)
+#define FRQGENPPSLOCK (500*16)          // Lock window (ppb*16)
+#define FGPPSK        (16000000000LL/F_CPU)   // ppb*16 per count of error
 
 #if FRQGENDEBUG
-#define printfROM(fmt, ...)   printf_P(PSTR(fmt),##__VA_ARGS__)
+static byte FGQuiet;                    // (no debug output from 'applyFromISR')
+#define printfROM(fmt, ...)   do { if (!FGQuiet) printf_P(PSTR(fmt),##__VA_ARGS__); } while (0)
 #endif
 
-#if !(defined(__AVR_ATmega32U4__) || defined(__AVR_ATmega16U4__))
+#if !FRQGENHOST && !(defined(__AVR_ATmega32U4__) || defined(__AVR_ATmega16U4__))
 #error "This module (FrequencyGenerator.cpp) only supports ATMega32U4/16U4"
 #endif
 
+// Output pin port registers (driven directly so that 'apply' stays short)
+#if FRQGENUSEPB6
+#define FRQGENDDR     DDRB              // PB6 (Arduino pin 10) and OC4B
+#define FRQGENPORT    PORTB
+#define FRQGENPIN     PINB
+#define FGCOM         (1<<COM4B0)       // (TCCR4A output mode, PWM and force bits)
+#define FGPWM         (1<<PWM4B)
+#define FGFOC         (1<<FOC4B)
+#define FGPINSTART    (1<<FRQGENBIT)    // (pin at the start of a cycle, OC4B high)
+#else
+#define FRQGENDDR     DDRC              // PC6 (Arduino pin 5) and OC4A-
+#define FRQGENPORT    PORTC
+#define FRQGENPIN     PINC
+#define FGCOM         (1<<COM4A0)
+#define FGPWM         (1<<PWM4A)
+#define FGFOC         (1<<FOC4A)
+#define FGPINSTART    0                 //   (OC4A- low)
+#endif
+#define FRQGENBIT     6
 
-#if 0
-byte _pin;
-FrequencyGenerator::FrequencyGenerator(int pin) { pinMode(pin, OUTPUT);  _pin = pin; }
+#if FRQGENNOUSB
+// Timer clocks when the PLL frequency (PDIV3:0) may also be changed.  The PLL 
+// runs at 40 to 96MHz in 8MHz steps (from its 8MHz input) and its output to 
+// the timer is divided by 1, 1.5 or 2 (PLLTM1:0).  Each distinct clock of 
+// 64MHz or less is listed once (with the highest PDIV when more than one 
+// gives it) along with the system clock.  'ck' is the clock in 4/3 MHz units,
+// so the clock is always ck*4000000/3.  'frq' is PLLTM<<4 | PDIV.
+static const struct { byte frq, ck; } FGClocks[] PROGMEM =
 {
-  _FreqGenVal=0; _pin=10;
+  {0x00,F_CPU*3/4000000},   //  System clock (no PLL)
+  {0x33,15}, {0x34,18},     //  20.00, 24.00 MHz  (40MHz/2, 48MHz/2)
+  {0x23,20}, {0x35,21},     //  26.67, 28.00 MHz  (40MHz/1.5, 56MHz/2)
+  {0x36,24}, {0x37,27},     //  32.00, 36.00 MHz  (64MHz/2, 72MHz/2)
+  {0x25,28}, {0x38,30},     //  37.33, 40.00 MHz  (56MHz/1.5, 80MHz/2)
+  {0x26,32}, {0x39,33},     //  42.67, 44.00 MHz  (64MHz/1.5, 88MHz/2)
+  {0x3A,36}, {0x28,40},     //  48.00, 53.33 MHz  (96MHz/2, 80MHz/1.5)
+  {0x15,42}, {0x29,44},     //  56.00, 58.67 MHz  (56MHz/1, 88MHz/1.5)
+  {0x2A,48}                 //  64.00 MHz         (96MHz/1.5)
+};
+#define FGNUMCLOCKS   (sizeof(FGClocks)/sizeof(FGClocks[0]))
+
+
+#else   // FRQGENNOUSB
+
+static const byte CKM[]={1,6,4,3};  // Clock pll multipliers (16,96,64,48 Mhz)
+
+// Band table.  For each pll the prescaler (lg) is the bit length of 
+// CK/1024/Freq, so it only changes where Freq crosses (CK/1024)>>k.  The table
+// holds all of those crossings for the three usable clocks in ascending order.
+// Each entry is the top (inclusive) of a band of frequencies and the lg that 
+// each pll uses in that band, one nibble per pll index (15 = not usable).  It 
+// is built by the compiler from F_CPU.  Clock ratios of 1:4:3 make the order 
+// X, 4X/4, 3X/2, 2X, ... (X=F_CPU/1024) so one octave is 3 entries.
+#define FGCK1         ((F_CPU*1)>>10)
+#define FGCK4         ((F_CPU*4)>>10)
+#define FGCK3         ((F_CPU*3)>>10)
+
+static constexpr byte FGBits(unsigned long n)
+  // Bit length of 'n' (compile time use only)
+{
+  return n ? 1+FGBits(n>>1) : 0; 
+}
+
+static constexpr unsigned FGLg(unsigned long C, unsigned long F)
+  // Prescaler lg for clock/1024 'C' at band top 'F' (15 if too big)
+{
+  return (!F || FGBits(C/F)>14) ? 15 : FGBits(C/F); 
+}
+
+#define FGBAND(F)     { (F), (unsigned)(FGLg(FGCK1,F) | (15<<4) | \
+                        (FGLg(FGCK4,F)<<8) | (FGLg(FGCK3,F)<<12)) }
+#define FGOCT(j)      FGBAND(FGCK1>>(j)), FGBAND(FGCK4>>((j)+2)), \
+                      FGBAND(FGCK3>>((j)+1))
+
+static const struct { unsigned long top; unsigned lgs; } FGBands[] PROGMEM =
+{
+  FGOCT(14), FGOCT(13), FGOCT(12), FGOCT(11), FGOCT(10), FGOCT(9), FGOCT(8), 
+  FGOCT(7),  FGOCT(6),  FGOCT(5),  FGOCT(4),  FGOCT(3),  FGOCT(2), FGOCT(1), 
+  FGOCT(0),  FGBAND(FGCK4>>1), FGBAND(FGCK3), FGBAND(FGCK4), 
+  { 0x7FFFFFFFL, 15<<4 }              // Above FGCK4 all clocks use lg=0
+};
+#define FGNUMBANDS    (sizeof(FGBands)/sizeof(FGBands[0]))
+
+
+static unsigned long DivU3(unsigned long n)
+  // Return n/3 using only shifts and adds (no call to the long divide routine).
+{
+  unsigned long q=(n>>2)+(n>>4);  
+  q+=q>>4;  q+=q>>8;  q+=q>>16;   // q is now n/3 or a little below it 
+  n-=q*3;                         // remainder (0..11)
+  return q+((11*(byte)n)>>5);     // and correct q 
+}
+#endif  // FRQGENNOUSB
+
+
+static byte BitLen(unsigned long n)
+  // Return the number of significant bits in 'n' (the log2 of 'n' plus 1, or
+  // 0 if 'n' is 0).  The top non-zero byte is found first so that at most 8
+  // single bit shifts (of a byte) are needed.
+{
+  byte b=0, v; 
+  if      (n>>24) { b=24; v=n>>24; }
+  else if (n>>16) { b=16; v=n>>16; }
+  else if (n>>8)  { b=8;  v=n>>8;  }
+  else            {       v=n;     }
+  while (v) { b++;  v>>=1; }
+  return b; 
+}
+
+
+static byte LgOf(unsigned long A, unsigned long B, byte lgB)
+  // Return the prescaler (lg) for a clock/1024 of 'A' and frequency 'B' (with
+  // bit length 'lgB').  This is the bit length of A/B (0 if A<B), which is the 
+  // difference of the bit lengths of A and B or one more, so one compare 
+  // picks it.  (15 or more means no prescaler is big enough)
+{
+  byte lg=0; 
+  if (A>=B) 
+  {
+    lg=BitLen(A)-lgB; 
+    if (lg<15 && A>=(B<<lg)) lg++; 
+  }
+  return lg; 
+}
+
+
+static unsigned FGCount(unsigned long Nhi, unsigned Nlo, unsigned long D, 
+                        byte &lg, byte enh, unsigned long &err)
+  // Return the count (N/D rounded) for prescaler 'lg', where N is the clock 
+  // times 2 (times 4 in enhanced mode) and D is the frequency times the 
+  // prescaler.  The clock is passed as clock/1024 ('Nhi') and its low 10 
+  // bits ('Nlo') so that it may be bigger than a long (the clock times 1000 
+  // for mHz), and the times 2 (4) is the extra step of the loop.  'lg' must 
+  // be the smallest prescaler that keeps N/D under 2048 (4096 in enhanced 
+  // mode), so the quotient is found with 11 (12) steps of shift and subtract.
+  // 'err' is set to |CK-PS*cnt*Freq| (|CK*2-...| in enhanced mode) which falls
+  // out of the remainder.  Returns 0 if the count is out of range.  'lg' is 
+  // changed if the next prescaler up is used.
+{
+  byte i,c;  unsigned q=0,cnt;  unsigned long rem=Nhi;
+
+  Nlo<<=6;                          // low bits of N, MSB first
+  for (i=0; i<11+enh; i++)
+  {
+    // (rem can be over 2^31 if D is, so keep the bit shifted out)
+    c=((long)rem<0);  rem<<=1;  if (Nlo&0x8000) rem|=1;  Nlo<<=1;  q<<=1; 
+    if (c || rem>=D) { rem-=D;  q|=1; }
+  }
+  // The count is the quotient rounded ((q+1)/2). 
+  cnt=(q+1)/2; 
+  // If the count rounded up past the top (the quotient is just under 2048)
+  // try the next prescaler up (lg+1).  Its count is then 512 with an error
+  // of no more than a half count, and its quotient and remainder come from 
+  // this division (q/2, and rem+D if q was odd) so no new division is done.
+  // (Such a count can tie with another clock's, see FGTop for which is used)
+  // (The next prescaler down (lg-1) is never tried: lg is the smallest that 
+  // keeps the count under 1024, so lg-1 always gives a count too big).
+  if (cnt>(0x3FFU|((unsigned)enh<<10)) && lg<14) 
+  {
+    if (q&1) rem+=D;  
+    q>>=1;  D<<=1;  lg++;  cnt=(q+1)/2; 
+  }
+  // If cnt is too small or too big, this clock value can't be used
+  //   (NOTE: OCR4C min value is 3.  See data sheet!)
+  //   (In enhanced mode the count is twice as big and can be up to 0x7FF)
+  if (cnt<(4U<<enh) || cnt>(0x3FFU|((unsigned)enh<<10))) return 0;   
+  // The difference between the desired frequency and the actual frequency 
+  // (as CK-(PS*cnt*Freq)) is rem/2 if the count was rounded down or 
+  // (D-rem)/2 if it was rounded up.
+  err=((q&1) ? D-rem : rem)>>1; 
+  return cnt; 
 }
+
+
+// Clock calibration.  Every clock is a small multiple m of a clock unit 
+// (F_CPU, or 4MHz for 3 times the clock with FRQGENNOUSB) and FGCalQ is the 
+// real frequency of that unit in 1/2^FGQSH Hz.  'calibrate' works it out once
+// from the error in ppb, so the solver only multiplies it by m (and needs no 
+// more than a long for it).
+#if FRQGENNOUSB
+#define FGQSH         10                // FGCalQ is 4MHz in 1/1024 Hz
+#define FGQNOM        (4000000UL<<FGQSH)
+#else
+#define FGQSH         8                 // FGCalQ is F_CPU in 1/256 Hz
+#define FGQNOM        ((unsigned long)F_CPU<<FGQSH)
 #endif
+#define FGQK          (FGQSH+7)         // (see FGClockHL)
+static unsigned long FGCalQ=FGQNOM;     // Calibrated clock unit
+static long FGCalPpb;                   // and its error in ppb
+static long FGTempPpb;                  //   (plus the temperature correction)
+static long FGPpsPpb;                   // or the PPS estimate in use
+static byte FGPpsOn;                    //   (1 if it is used instead)
 
-long FrequencyGenerator::read(void)  
-  //  Return the current setting of the frequency generator.
-{ 
-  return _FreqGenVal; 
+
+static unsigned long FGClockHL(byte m, unsigned long &L)
+  // Return m*FGCalQ>>FGQK and set 'L' to the low FGQK bits of m*FGCalQ.  
+  // (m*FGCalQ needs more than a long, so FGCalQ is split at bit FGQK)
+{
+  unsigned long l=(unsigned long)m*(FGCalQ&((1UL<<FGQK)-1)); 
+  L=l&((1UL<<FGQK)-1); 
+  return m*(FGCalQ>>FGQK)+(l>>FGQK); 
 }
 
 
-long FrequencyGenerator::set(long Freq)
-  // Set Timer4 to the frequency specified by 'Freq' (if 'Freq' > 0), shut off 
-  // frequency generator (if 'Freq' is 0) or return current frequency (if 'Freq'
-  // < 0).  Output the frequency on PC6 (Arduino pin 5) or alternatively on PB6 
-  // (Arduino pin 10). 
-  // NOTE: Frequency output may not match specified frequency but will be as 
-  // close to it as is possible for the system clock speed.  Max frequency is 
-  // crystal clock rate.  
-  // Function returns current frequency if ok or -1 if unable to set to the 
-  // desired frequency. 
+static uint32_t FGMulHL(uint32_t A, uint32_t B, uint32_t &L)
+  // Return the high 32 bits of A*B and set 'L' to the low 32 bits.  (Four 16
+  // by 16 bit multiplies, which is much less work on the AVR than a long 
+  // long multiply)
+{
+  uint32_t ll=(A&0xFFFF)*(B&0xFFFF), lh=(A&0xFFFF)*(B>>16); 
+  uint32_t hl=(A>>16)*(B&0xFFFF), m=(ll>>16)+(lh&0xFFFF)+(hl&0xFFFF); 
+  L=(m<<16)|(ll&0xFFFF); 
+  return (A>>16)*(B>>16)+(lh>>16)+(hl>>16)+(m>>16); 
+}
+
+
+static unsigned long FGSplit(byte m, byte Milli, unsigned &Nlo)
+  // Return the clock m*FGCalQ (times 1000 if 'Milli') over 1024 and set 'Nlo' 
+  // to its low 10 bits, as FGCount takes it.  With H and L from FGClockHL the
+  // clock is H*128+L/2^FGQSH, so the clock*1000/1024 is H*125+L*125/2^FGQK 
+  // and the low bits of clock*1000 only come from L (H*128000 has none).
+{
+  unsigned long L, H=FGClockHL(m,L); 
+  if (Milli) { Nlo=((L*1000)>>FGQSH)&0x3FF;  return H*125+((L*125)>>FGQK); }
+  Nlo=((H&7)<<7)|(L>>FGQSH);  
+  return H>>3; 
+}
+
+
+static byte FGUnits3(const FrequencyGenerator::Plan &P)
+  // Return 3 times the Timer4 clock used by plan 'P' in clock units (the m 
+  // of FGCalQ).
+{
+#if FRQGENNOUSB
+  // The PLL runs at 8MHz*(PDIV+2) and PLLTM divides it by 1, 1.5 or 2
+  static const byte PM[]={6,4,3}; 
+  if (!P.pll) return F_CPU*3/4000000; 
+  return (P.pdiv+2)*PM[P.pll-1]; 
+#else
+  return 3*CKM[P.pll&3]; 
+#endif
+}
+
+
+static unsigned long FGClock3(const FrequencyGenerator::Plan &P)
+  // Return 3 times the Timer4 clock used by plan 'P' (a whole number for 
+  // every clock, rounded to the Hz if it is calibrated).
+{
+  unsigned long L, H=FGClockHL(FGUnits3(P),L); 
+  return (H<<7)+((L+(1UL<<(FGQSH-1)))>>FGQSH); 
+}
+
+
+static long FGMilli(unsigned long N, unsigned long D, byte sh)
+  // Return N*(2^sh)*1000/D rounded (0x7FFFFFFF if that is too big for a 
+  // long).  The whole part is one long divide, then 'sh' binary places and 
+  // each of the 3 decimal places are the remainder times 2 (or 10) divided 
+  // again, so the math never needs more than a long.  (D*10 must fit in an
+  // unsigned long)
+{
+  unsigned long q=N/D, r=N%D;  byte i;
+
+  for (i=0; i<sh; i++) { r<<=1;  q<<=1;  if (r>=D) { r-=D;  q|=1; } }
+  if (q>=2147483UL) return 0x7FFFFFFFL; 
+  for (i=0; i<3; i++) { r*=10;  q=q*10+r/D;  r%=D; }
+  if (r*2>=D) q++;                    // round 
+  return q; 
+}
+
+
+static long FGPpb(unsigned long long E, unsigned long long Z)
+  // Return E*1e9/Z rounded (E must be less than Z).  Both are shifted down 
+  // until Z fits in 28 bits (so the error is still good to a few ppb) and 
+  // then the 9 decimal places are found one at a time as in FGMilli. 
+{
+  unsigned long q=0,r,d;  byte i; 
+
+  while (Z>>28) { Z>>=1;  E>>=1; }
+  r=E;  d=Z; 
+  for (i=0; i<9; i++) { r*=10;  q=q*10+r/d;  r%=d; }
+  if (r*2>=d) q++;                    // round 
+  return q; 
+}
+
+
+static bool FGStep(FrequencyGenerator::Plan &N, 
+                   const FrequencyGenerator::Plan &P, byte Up)
+  // Set 'N' to the plan for the next higher (Up=1) or lower (Up=0) frequency
+  // that can be made from plan 'P' (which must be on).  Returns false if there 
+  // isn't one.  The frequency of a plan is m/(cnt*2^lg) (times F_CPU, and times 2 in 
+  // enhanced mode) with m the pll multiplier, so for each pll the count 
+  // closest to the current frequency with prescaler lg is 
+  //   X = m*cnt0*2^lg0/(m0*2^lg)   
+  // and the next count up or down from it is the closest one for that pll 
+  // and prescaler.  Only the smallest prescaler whose count fits (and the 
+  // ones on either side of it, for band edges) can give the nearest 
+  // frequency, as bigger prescalers make the same frequencies with smaller 
+  // counts.  The candidates are compared by cross multiplying so the step 
+  // needs no divides (m0 is 1, 3 or 4 so X is found with shifts and DivU3).
+  // (A dithered plan's count is cnt+frac/65536, so work in 1/65536 counts)
+  // With FRQGENNOUSB all of the clocks in FGClocks are stepped the same way
+  // with m the clock in clock units (see FGUnits3), and X needs one divide 
+  // by m0 for each clock.
 {
-  byte pll,lg,svPLL=0,svLG=0; unsigned PS,cnt,svCNT=0;  long CK, CV,dif,svDIF=0; 
-  static byte CKM[]={1,6,4,3};  // Clock pll multipliers (16,96,64,48 Mhz)
+  unsigned long T,V,q,A,B;  unsigned cmin,cmax;  byte i,m,m0,mb=0,l,lgm,sh,ex; 
 
-  if (Freq<0L) goto DONE; 
-  if (!Freq) _FreqGenVal=0;  else
+  N=P;  N.frac=0;  N.pdiv=P.pdiv; 
+  cmin=4<<P.enh;  cmax=0x3FF|(P.enh<<10); 
+#if FRQGENNOUSB
+  byte frq; 
+  m0=FGUnits3(P); 
+  for (i=0; i<FGNUMCLOCKS; i++)
+  {
+    m=pgm_read_byte(&FGClocks[i].ck); 
+#else
+  m0=CKM[P.pll]; 
+  for (i=0; i<sizeof(CKM); i++)
   {
-    svDIF=0x7FFFFFFFL; 
-    for (pll=0; pll<sizeof(CKM); pll++)
+    if (i==1) continue;               // (96MHz can't be used)
+    m=CKM[i]; 
+#endif
+    // V is X*2^(lg+16-lg0) and ex is 1 if m*cnt0/m0 has no remainder
+#if FRQGENNOUSB
+    // (m*cnt0*65536 could overflow, so (T/m0)*m plus the remainder's part)
+    T=((unsigned long)P.cnt<<16)|P.frac; 
+    q=(T%m0)*m;  V=(T/m0)*m+q/m0;  ex=!(q%m0); 
+#else
+    T=m*(((unsigned long)P.cnt<<16)|P.frac); 
+    V=(m0==4) ? T>>2 : (m0==3) ? DivU3(T) : T; 
+    ex=(V*m0==T); 
+#endif
+    lgm=BitLen((V>>(16-P.lg))>>(10+P.enh));   // smallest prescaler that fits
+    for (l=(lgm ? lgm-1 : 0); l<=lgm+1 && l<15; l++)
     {
-      CK=F_CPU*CKM[pll];          // Clock freq for this pll setting
-      CV=CK / Freq / 1024; 
-      // Find the log2 of CV
-      // From this routine:  for (val = 0; n > 1; val++, n >>= 1);
-      // Modified with "if n=0 return 0" and "return Val+1"
-      lg=0; if (CV != 0) 
+      sh=l+16-P.lg;  q=V>>sh; 
+      if (Up) 
       {
-        while (CV > 1) { lg++;  CV=CV>>1; }
-        lg++;
+        // Biggest count under X (the count is at most cmax)
+        if (ex && !(V&((1UL<<sh)-1))) q--; 
+        if (q>cmax) q=cmax; 
+        if (q<cmin) continue; 
       }
-      // If pll==1 (96MHz) then ignore this PLL value (counter can't run @96MHz)
-      // If the lg2(CV) is out of range of prescaler, ignore this CLK value
-      if (pll==1  || lg > 14) continue;              
-      // Create the prescaler value and the count value
-      PS=1<<lg;  cnt=((CK*2/PS/Freq)+1)/2;
-      // If cnt is too small or too big, ignore this clock value  
-      //   (NOTE: OCR4C min value is 3.  See data sheet!)
-      if (cnt<4 || cnt>0x3FF) continue;   
-      // Calculate the difference between the desired frequency and the 
-      // actual frequency these divisors will produce.
-      // Instead of dividing clock down by the PS/count/freq, multiply PS,cnt,
-      // freq and then subtract from  clk... Then divide by the pll scale.  
-      // Then absolute.  The resultant integer is the difference in lots of 
-      // counts (eg the most precision we can do with ints).  Save/compare this 
-      // integer value to figure out which setting is the closest to the 
-      // desired frequency.
-      dif=(CK - ((long)PS*(long)cnt*Freq));  dif=dif/((long)CKM[pll]);  
-      if (dif<0) dif=-dif;
-      // Note: the below doesn't work (using freq 1050000).. longdiv routine blows up... so do it like above instead (it works). 
-      // dif=(CK - ((long)PS * (long)cnt * Freq))/(long)CKM[pll];  if (dif<0) dif = -dif;
-#if FRQGENDEBUG
-      CV=(((CK*2)/((long)PS*(long)cnt))+1)/2;  // frequency
-      printfROM("CLK=%dM  Pll=%d PS=%-5d Cnt=%-4d Freq=%-8ld Er=%ld\n",
-                (int)(CK/1000000), pll,(1<<lg) ,cnt, CV, dif); // CKM[pll]);
-#endif
-      // If this is the smallest error value then save these settings 
-      if (dif<svDIF) { svPLL=pll; svLG=lg; svCNT=cnt; svDIF=dif; }
-      // If this is the smallest error value or if err is same and the prescale 
-      // value is greater than the current prescale value
-      // if (dif<svDIF || (dif==svDIF && lg>svLG)) 
-      // { svPLL=pll; svLG=lg; svCNT=cnt; svDIF=dif; }
-    }
-    if (svDIF<0x7FFFFFFFL)
-    {
-      // Calculate the actual frequency output
-      //   For integer frequency Mult clk *2 then do calc, then add 1, then 
-      //   div 2. This gives an output frequency that is (Freq+0.5) then trunc 
-      //   to whole number.   
-      //   This makes 0.51 output a 1. (eg. an integer "round" function)
-      _FreqGenVal=((((F_CPU*CKM[svPLL])*2)/((long)(1<<svLG)*(long)svCNT))+1)/2;
-#if FRQGENDEBUG
-      printfROM("Selectd: Pll=%d PS=%-5d Cnt=%-4d Freq=%-8ld\n",
-                svPLL,(1<<svLG),svCNT,_FreqGenVal);  
-#endif
-    }
-    else  // We never found a valid set of divisors, get out
-    {
-#if FRQGENDEBUG
-      printfROM(" ***  No divisors found  ***\n");   
+      else 
+      {
+        // Smallest count over X (the count is at least cmin)
+        q++; 
+        if (q<cmin) q=cmin; 
+        if (q>cmax) continue; 
+      }
+      // Keep it if it is closer than the best so far (lower frequency than
+      // the best for Up, higher for down).  m*cb*2^lb < mb*c*2^l if lower. 
+      if (mb)
+      {
+        A=((unsigned long)m*N.cnt)<<N.lg;  B=((unsigned long)mb*q)<<l; 
+        if (Up ? A>=B : A<=B) continue; 
+      }
+#if FRQGENNOUSB
+      frq=pgm_read_byte(&FGClocks[i].frq);  N.pll=frq>>4;  N.pdiv=frq&0xF; 
+#else
+      N.pll=i;  N.pdiv=0xA; 
 #endif
-      return -1; 
+      N.lg=l;  N.cnt=q;  mb=m; 
     }
   }
-  //
-  // Now _FreqGenVal is 0 for turn off or >0 for set new frequency
-  // Set the timer registers to the calculated values
-  //
-  TCCR4D=0;             // Reset this to 0 (init() set it for PWM mode)
-  if (!_FreqGenVal)     // Turn off, shut down timer.
+  if (!mb) return false;              // Nothing higher (lower) 
+  // Frequency (rounded as in 'solve')
+  N.freq=(((FGClock3(N)<<(1+N.enh))/((3UL*N.cnt)<<N.lg))+1)/2; 
+  return true; 
+}
+
+
+#if FRQGENDITHER
+#if !FRQGENHOST
+static volatile unsigned FGDTop;            // Dither OCR4C (for cnt)
+static volatile uint16_t FGDFrac;           // Dither fraction (1/65536 counts)
+static uint16_t FGDAcc;                     // Dither accumulator (ISR only)
+#endif  // !FRQGENHOST
+
+
+static void FGDither(FrequencyGenerator::Plan &P, unsigned long F, byte Milli)
+  // Set the count of plan 'P' to the count for frequency 'F' (in mHz if 
+  // 'Milli') rounded down and 'frac' to the rest of it in 1/65536 counts.  
+  // The count is N/D as in FGCount (3 times the clock and 3 times the 
+  // frequency), found with 10 (11) shift and subtract steps for the whole 
+  // count then 17 more for the fraction (the last one to round it).  
+{
+  unsigned long rem, D, x=0;  unsigned Nlo;  byte i,c; 
+
+  rem=FGSplit(FGUnits3(P),Milli,Nlo); 
+  D=(F*3)<<P.lg;  Nlo<<=6; 
+  for (i=0; i<27+P.enh; i++)
   {
-    // Shut off timer (if it's running) and release the IO 
-    TCCR4A=0; TCCR4B=0;                 // Shut down the timer
-    // turn off the IO bits
+    c=((long)rem<0);  rem<<=1;  if (Nlo&0x8000) rem|=1;  Nlo<<=1;  x<<=1; 
+    if (c || rem>=D) { rem-=D;  x|=1; }
+  }
+  x=(x+1)>>1;                       // round to 16 bits of fraction
+  P.cnt=x>>16;  P.frac=x&0xFFFF;  
+  if (P.frac) P.freq=(FGMilli(FGClock3(P)<<P.enh,3*x,16-P.lg)+500)/1000; 
+}
+#endif  // FRQGENDITHER
+
+
+#if !FRQGENHOST
+#if FRQGENSYNC
+// A plan 'apply' has staged for the overflow interrupt to commit (only the
+// counts, its clock is the one running).  Bit 0 of 'FGSyncPend' is set when 
+// 'FGSyncNext' holds a new plan, and bit 1 once its compare values are 
+// written and wait for TOP to load (so a newer plan can be staged meanwhile).
+static volatile byte FGSyncPend; 
+static volatile struct { unsigned top, ocr, frac; } FGSyncNext; 
+#endif
+
+#if FRQGENDITHER || FRQGENSYNC
+ISR(TIMER4_OVF_vect)
+  // Timer4 overflow, at TOP where a cycle starts.  
+  // With FRQGENSYNC commit a staged plan: write its compare values (OCR4C 
+  // and OCR4A are buffered and load together at the next TOP), and clear 
+  // 'pending' at the overflow after, once they are loaded.  The clock isn't 
+  // changed (see 'apply'), so no cycle is cut short or made of two plans.  
+  // With FRQGENDITHER dither the count.  Add the fraction to the accumulator
+  // every cycle and make the next cycle one count longer when it carries, so 
+  // the average count is cnt+frac/65536.  (OCR4C is buffered and loads at 
+  // TOP, so this sets the cycle after the one starting now)  Only a 16 bit 
+  // add and two register writes, so it keeps up to well over FRQGENDITHERMAX.
+{
+  unsigned top; 
+#if FRQGENSYNC
+  byte s=FGSyncPend; 
+  if (s&1)                          // New plan, write its compare values
+  {
+    top=FGSyncNext.ocr; 
 #if FRQGENUSEPB6
-    pinMode(10,INPUT_PULLUP);           // PB6 and OC4B
+    TCNT4H /*upper OCR4B*/ =(top>>8);  OCR4B=(top&0xFF); 
 #else
-    pinMode(5, INPUT_PULLUP);           // PC6 and OC4A-
+    TCNT4H /*upper OCR4A*/ =(top>>8);  OCR4A=(top&0xFF); 
 #endif
-#if FRQGENDEBUG
-    printfROM("Generator off\n"); 
+    top=FGSyncNext.top; 
+#if FRQGENDITHER
+    FGDTop=top;  FGDFrac=FGSyncNext.frac;  FGDAcc=0;   // (OCR4C below)
+#else
+    TCNT4H /*upper OCR4C*/ =(top>>8);  OCR4C=(top&0xFF); 
 #endif
+    s=2; 
   }
-  else    // *****  Now set up the timer to the values calculated  *****
-  {
-    // Set IO bits as needed for output. Also set TCCR4A.
-#if FRQGENUSEPB6
-    pinMode(10, OUTPUT);                // PB6 and OC4B
-    TCCR4A = (1<<PWM4B)|(1<<COM4B0);    // Toggle on compare match (COMP B out)
+  else s=0;                         // (bit 1: the values just loaded)
+  FGSyncPend=s; 
+#endif
+#if FRQGENDITHER
+  top=FGDTop; 
+  FGDAcc+=FGDFrac; 
+  if (FGDAcc<FGDFrac) top++;        // carry, use cnt+1 
+  TCNT4H /*upper OCR4C*/ =(top>>8);  OCR4C=(top&0xFF); 
+#endif
+#if FRQGENSYNC
+  // Done when the plan is in (unless it is dithering)
+#if FRQGENDITHER
+  if (!s && !FGDFrac) TIMSK4&=~(1<<TOIE4); 
 #else
-    pinMode(5, OUTPUT);                 // PC6 and OC4A-
-    TCCR4A = (1<<PWM4A)|(1<<COM4A0);    // Toggle on compare match (COMP A out)
+  if (!s) TIMSK4&=~(1<<TOIE4); 
 #endif
-    // Note: When just powering up module (no code download) then PLLFRQ is 
-    // PDIV3:0=48MHz and PLLUSB=0 (/1).  After downloading code then PLLFRQ 
-    // is PDIV3:0=96MHz and PLLUSB=1 (/2)  This causes all frequencies that 
-    // use PLLFRQ to be 1/2 of expected values (if no code download).  
-    //PLLFRQ=(PLLFRQ & ~(0x30))|((cpll&3)<<4); // Set PLLFRQ to input clock we want.
-    // Use this instead... (force 96MHz /2 mode)
-    PLLFRQ = 0x4A | ((svPLL&3)<<4);       // Set PLLFRQ to input clock we want.
-    // Now set OCR4C and either OCR4A or OCR4B
-    PS=(svCNT/2)-1;     // set OCR4A/B to (1/2 of svCNT)-1 for 50% duty cycle
-    svCNT-=1;  // Dont forget to subtract 1 from the count loaded into OCR4C !!
-    TCNT4H /*upper OCR4C*/ =(svCNT>>8); OCR4C=(svCNT&0xFF); // set counter TOP value
+#endif
+}
+#endif  // FRQGENDITHER || FRQGENSYNC
+
+static unsigned FGOcr(unsigned Cnt, unsigned long K)
+  // Return OCR4A (OCR4B) for count 'Cnt' with OC4x high for K/65536 of the 
+  // cycle (see FGDutyK), and at least one count high and one low.  K=32768 
+  // gives (cnt/2)-1, 50%.  
+{
+  unsigned h=(Cnt*K)>>16; 
+  if (!h) h=1; 
+  if (h>=Cnt) h=Cnt-1; 
+  return h-1; 
+}
+
+static unsigned long FGRatio12(unsigned N, unsigned D)
+  // Return N*4096/D (N and D up to 0x400) a bit at a time by shifting and 
+  // subtracting, so 'apply' needs no call to the long divide routine.
+{
+  unsigned long n=(unsigned long)N<<12, q=0;  unsigned r=0;  byte i; 
+  for (i=23; i--; )
+  {
+    r=(r<<1)|((n>>i)&1);  q<<=1; 
+    if (r>=D) { r-=D;  q|=1; }
+  }
+  return q; 
+}
+
+// Shadow copies of the Timer4 and PLL registers 'apply' last wrote, so that
+// it only writes the ones that change.  'on' is 0 if the timer is off (then
+// all of them are written), 'dith' is 1 if the dither ISR may have 
+// changed OCR4C and 'mute' is 1 if the output is muted (see 'mute').
+static struct { byte on, pllfrq, tccr4b, enh, dith, mute;  unsigned top, ocr; } FGReg;
+
+static void FGPhaseLoad(byte Pll, byte Enh, unsigned Top, unsigned Ocr, byte Ps, 
+                        byte Reset, unsigned long K)
+  // Load a plan at once with the counter stopped (for 'phase').  If 'Reset'
+  // the counter and prescaler start from 0 and the output is put at the 
+  // start of a cycle, else the count is scaled by 'K' (the new period over 
+  // the old in 1/4096ths) so it is as far through the new cycle.  The compare
+  // registers are buffered in the PWM mode, so they are written in the normal
+  // mode (where FOC also works) and the PWM mode is then put back.  OC4A- 
+  // (PC6) is only connected in the PWM mode, so the output level is read 
+  // before leaving it and the PORT bit holds the pin there meanwhile.  
+  // Interrupts are off for all of it (a few dozen cycles).
+{
+  unsigned t=0;  byte sreg=SREG, com=FGReg.mute ? 0 : FGCOM, lv, pt; 
+  cli(); 
+  TCCR4B=0;                         // stop the counter
+  lv=FRQGENPIN&(1<<FRQGENBIT);      // (the waveform, still in PWM mode)
+  pt=FRQGENPORT; 
+  if (!Reset) 
+  { 
+    t=TCNT4;  t|=(TCNT4H<<8);       // (low byte first for the 10 bits)
+    t=((unsigned long)t*K)>>12; 
+  }
+  if (PLLFRQ!=Pll) PLLFRQ=Pll; 
+  if (com) FRQGENPORT=(pt&~(1<<FRQGENBIT))|lv;   // (hold the pin as it is)
+  TCCR4A=com;                       // normal mode
+  if (Enh) TCCR4E|=(1<<ENHC4);  else TCCR4E&=~(1<<ENHC4); 
+  TCNT4H /*upper OCR4C*/ =(Top>>8);  OCR4C=(Top&0xFF); 
 #if FRQGENUSEPB6
-    // Set OCR4b to a value.  set to (1/2 of svCNT value)-1 for 50%;  
-    TCNT4H /*upper OCR4B*/ =(PS>>8); OCR4B=(PS&0xFF); 
+  TCNT4H /*upper OCR4B*/ =(Ocr>>8);  OCR4B=(Ocr&0xFF); 
 #else
-    // Set OCR4a- to a value.  set to (1/2 of svCNT value)-1 for 50%;  
-    TCNT4H /*upper OCR4A*/ =(PS>>8); OCR4A=(PS&0xFF); 
+  TCNT4H /*upper OCR4A*/ =(Ocr>>8);  OCR4A=(Ocr&0xFF); 
 #endif
-    // Finally set set prescaler and run 
-    TCCR4B=(svLG+1)&0xF; 
+  // Toggle the output to the start of a cycle if it isn't.  (Not if muted 
+  // as the pin isn't the output, which is right after the first cycle)  For
+  // PC6 the pin follows when the PWM mode is back.
+  if (Reset && com && lv!=FGPINSTART) TCCR4A=com|FGFOC; 
+  TCNT4H=(t>>8);  TCNT4=(t&0xFF); 
+  TCCR4A=com|FGPWM;                 // back to PWM mode
+  FRQGENPORT=pt;                    // (PORT bit back low for 'mute')
+  TCCR4B=Ps|(Reset ? (1<<PSR4) : 0);  // and run (from a reset prescaler)
+  SREG=sreg; 
+}
+
 #if FRQGENDEBUG
-    cnt=OCR4C; cnt=cnt | (TCNT4H<<8);
-    printfROM("PLLFRQ=0x%X, TCCRB=%d, OCRC=%d, CK=%d, PS=%d, cnt=%d, OCRA=%d\n",
-              PLLFRQ, TCCR4B&0xF, cnt, (unsigned)((F_CPU*CKM[svPLL])/1000000),
-              ((unsigned)1)<<((unsigned) ((TCCR4B&0xF)-1)), svCNT,
-              ((OCR4A)|(TCNT4H<<8)) );   
+// Cycles taken by the register writes of 'apply' (for debug).  Timer1 counts
+// the clock for it (unless FRQGENPPS=1 already has it counting the clock).  
+// Its mode, count and flags are put back after, so Timer1 (Servo etc.) just
+// stands still for those cycles, with its OC1x pins let go meanwhile.
+static unsigned FGCycles; 
+#if FRQGENPPS==1
+#define FGCYCSTART()  unsigned FGT0=TCNT1
+#define FGCYCEND()    FGCycles=TCNT1-FGT0
+#else
+#define FGCYCSTART()  byte FGA=TCCR1A, FGB=TCCR1B, FGF=TIFR1;  unsigned FGT=TCNT1; \
+                      TCCR1B=0;  TCCR1A=0;  TCNT1=0;  TCCR1B=(1<<CS10)
+#define FGCYCEND()    FGCycles=TCNT1;  TCCR1B=0;  TCNT1=FGT; \
+                      TIFR1=(byte)~FGF;  /* (clear the flags set meanwhile) */ \
+                      TCCR1A=FGA;  TCCR1B=FGB
 #endif
+#endif  // FRQGENDEBUG
+#endif  // !FRQGENHOST
+
+
+#if FRQGENCACHE
+// Cache of the most recent plans, most recently used first.  'key' holds the 
+// mode the plan was solved in (bit 0 mHz, bit 1 hiRes, bit 2 dither).
+static struct { long f;  byte key;  FrequencyGenerator::Plan P; } FGCache[FRQGENCACHE];
+static byte FGCacheN;                       // Number of entries in use
+static unsigned long FGCacheHits, FGCacheMisses; 
+
+static bool FGCacheGet(long F, byte key, FrequencyGenerator::Plan &P)
+  // Look for frequency 'F' (solved in mode 'key') in the cache.  If found, 
+  // set 'P' to its plan, move it to the front and return true.  
+{
+  byte i; 
+  for (i=0; i<FGCacheN; i++)
+  {
+    if (FGCache[i].f==F && FGCache[i].key==key) 
+    {
+      P=FGCache[i].P; 
+      for ( ; i; i--) FGCache[i]=FGCache[i-1];      // move to the front
+      FGCache[0].f=F;  FGCache[0].key=key;  FGCache[0].P=P; 
+      FGCacheHits++; 
+      return true; 
+    }
   }
-DONE:  
-  return _FreqGenVal; 
+  FGCacheMisses++; 
+  return false; 
+}
+
+static void FGCachePut(long F, byte key, const FrequencyGenerator::Plan &P)
+  // Put plan 'P' for frequency 'F' at the front of the cache, dropping the 
+  // least recently used entry if it is full.  
+{
+  byte i; 
+  if (FGCacheN<FRQGENCACHE) FGCacheN++; 
+  for (i=FGCacheN-1; i; i--) FGCache[i]=FGCache[i-1]; 
+  FGCache[0].f=F;  FGCache[0].key=key;  FGCache[0].P=P; 
+}
+#endif  // FRQGENCACHE
+
+
+static unsigned long FGDutyK(unsigned Permille)
+  // Return the part of the cycle (in 1/65536ths) that OC4x is high for a 
+  // duty cycle of 'Permille' on the pin.  PC6 is OC4A-, the inverse of OC4A.
+  // The one divide is here so 'apply' only multiplies and shifts (FGOcr).
+{
+  unsigned long k; 
+  if (Permille>1000) Permille=1000; 
+  k=(((unsigned long)Permille<<16)+500)/1000; 
+#if !FRQGENUSEPB6
+  k=65536-k; 
+#endif
+  return k; 
+}
+
+
+// The best candidates of the last search, smallest error first.  The error
+// 'err' is relative to the clock: with the USB clocks it is already divided
+// by the pll scale, with FRQGENNOUSB it is compared as err/ck by cross 
+// multiplying.  'ck' is the clock in clock units (see FGCalQ).  'up' is 1 if
+// FGCount moved the count to the next prescaler up: it goes after the others
+// with the same error, so a tie keeps the choice the original search made.
+static struct { unsigned long err;  byte ck, pll, pdiv, lg, up;  unsigned cnt; } FGTop[FRQGENTOPK];
+static byte FGTopN;                         // Number of candidates
+static unsigned FGCntMin;                   // Smallest count wanted (see 'setDutyResolution')
+#if FRQGENNOUSB
+#define FGLESS(i,e,c) ((unsigned long long)(e)*FGTop[i].ck<(unsigned long long)FGTop[i].err*(c))
+#define FGSAME(i,e,c) ((unsigned long long)(e)*FGTop[i].ck==(unsigned long long)FGTop[i].err*(c))
+#else
+#define FGLESS(i,e,c) ((e)<FGTop[i].err)
+#define FGSAME(i,e,c) ((e)==FGTop[i].err)
+#endif
+#define FGBEFORE(i,e,c,u) (FGLESS(i,e,c) || (!(u) && FGTop[i].up && FGSAME(i,e,c)))
+
+static void FGTopAdd(unsigned long err, byte ck, byte pll, byte pdiv, byte lg, 
+                     unsigned cnt, byte up)
+  // Add a candidate to FGTop in order of error (after any with the same 
+  // error, so the first found stays first, but before those with 'up' set 
+  // if it hasn't).  If the list is full it only goes in if it comes before 
+  // the last one.
+{
+  byte i=FGTopN; 
+  if (i==FRQGENTOPK) { if (!FGBEFORE(i-1,err,ck,up)) return;  i--; }
+  else FGTopN++; 
+  for ( ; i && FGBEFORE(i-1,err,ck,up); i--) FGTop[i]=FGTop[i-1]; 
+  FGTop[i].err=err;  FGTop[i].ck=ck;  FGTop[i].pll=pll;  FGTop[i].pdiv=pdiv; 
+  FGTop[i].lg=lg;  FGTop[i].up=up;  FGTop[i].cnt=cnt; 
+}
+
+static void FGTopPlan(FrequencyGenerator::Plan &P, byte i)
+  // Set the divisors of plan 'P' to candidate 'i' and work out its frequency
+  // (rounded as in 'solve').
+{
+  P.pll=FGTop[i].pll;  P.pdiv=FGTop[i].pdiv;  P.lg=FGTop[i].lg;  P.cnt=FGTop[i].cnt; 
+  P.freq=(((FGClock3(P)<<(1+P.enh))/((3UL*P.cnt)<<P.lg))+1)/2;
+}
+
+static byte FGTopPick(byte Pol, const FrequencyGenerator::Plan &Cur)
+  // Return the candidate that policy 'Pol' picks.  Only the candidates with
+  // the same error as the best one are tied, and the policy breaks the tie:
+  // the biggest count, the slowest clock or the clock of plan 'Cur'.  The 
+  // list is already in order of error, so this is one pass over the ties.
+{
+  byte i,b=0; 
+  for (i=1; i<FGTopN && !FGLESS(i,FGTop[0].err,FGTop[0].ck); i++)
+  {
+    if ((Pol==FrequencyGenerator::MaxCount && FGTop[i].cnt>FGTop[b].cnt) ||
+        (Pol==FrequencyGenerator::LowestPll && FGTop[i].ck<FGTop[b].ck) ||
+        (Pol==FrequencyGenerator::KeepPll && (FGTop[b].pll!=Cur.pll || 
+         FGTop[b].pdiv!=Cur.pdiv) && FGTop[i].pll==Cur.pll && 
+         FGTop[i].pdiv==Cur.pdiv)) b=i; 
+  }
+  // If a finer duty cycle resolution is wanted and the pick's count is too 
+  // small take the best candidate with a count big enough (or the biggest).
+  if (FGTop[b].cnt<FGCntMin)
+  {
+    for (i=0; i<FGTopN && FGTop[i].cnt<FGCntMin; i++) continue; 
+    if (i<FGTopN) b=i; 
+    else for (i=0; i<FGTopN; i++) if (FGTop[i].cnt>FGTop[b].cnt) b=i; 
+  }
+  return b; 
+}
+
+
+FrequencyGenerator::FrequencyGenerator(void)
+  // Load the calibration saved in EEPROM (if there is one) so each board 
+  // comes up calibrated.
+{
+#if !FRQGENHOST
+  if (eeprom_read_byte((const uint8_t *)FRQGENEEADDR+4)==FRQGENEESIG) 
+    calibrate((int32_t)eeprom_read_dword((const uint32_t *)FRQGENEEADDR)); 
+#endif
+}
+
+// FGQNOM/1e9 (the clock unit change per ppb) in 1/2^29ths, worked out by 
+// the compiler.  (Under 2^32 for F_CPU up to 16MHz)
+#define FGQPPB        ((unsigned long)((((unsigned long long)FGQNOM<<29)+500000000ULL) \
+                                       /1000000000ULL))
+
+static void FGSetCal(void)
+  // Work out the clock unit FGCalQ for the calibration plus the temperature
+  // correction, or the PPS estimate (only when one of them changes).  The 
+  // change is |p|*FGQPPB>>29, rounded, multiplied in 16 bit halves so there
+  // is no long long math (or divide) to link in.
+{
+  long p=(FGPpsOn) ? FGPpsPpb : FGCalPpb+FGTempPpb; 
+  unsigned long a,ah,al,x,y; 
+  if (p>FRQGENCALMAX) p=FRQGENCALMAX; 
+  if (p<-FRQGENCALMAX) p=-FRQGENCALMAX; 
+  a=(p<0) ? -p : p;  ah=a>>16;  al=a&0xFFFF;      // (ah is 9 bits at most)
+  x=(al*(FGQPPB&0xFFFF))>>16; 
+  x+=((al*(FGQPPB>>16))&0xFFFF)+((ah*(FGQPPB&0xFFFF))&0xFFFF); 
+  y=ah*(FGQPPB>>16)+((al*(FGQPPB>>16))>>16)+((ah*(FGQPPB&0xFFFF))>>16)+(x>>16);
+  x=(y<<3)+((x&0xFFFF)>>13)+((x>>12)&1);          // (bits 29 up, rounded)
+  FGCalQ=(p<0) ? FGQNOM-x : FGQNOM+x; 
+#if FRQGENCACHE
+  FGCacheN=0;                         // (the cached plans are for the old clock)
+#endif
+}
+
+
+#if FRQGENTEMPCOMP && !FRQGENHOST
+static byte FGTcState;                      // 0 idle, 1 or 2 converting
+static unsigned long FGTcTime;              // millis() of the last reading
+static int FGTcAdc=-1;                      // Last reading (-1 if none)
+
+static long FGTempLookup(unsigned adc)
+  // Return the correction (ppb) for temperature reading 'adc' from the table 
+  // in EEPROM (a count then up to FRQGENTCPOINTS of reading (word) and ppb 
+  // (dword) in increasing reading order).  Straight lines between points and 
+  // the end values past the ends.  0 if there is no table.  
+{
+  const byte *e=(const byte *)FRQGENTCADDR;  byte n=eeprom_read_byte(e),i; 
+  unsigned a0,a1;  long p0,p1; 
+
+  if (!n || n>FRQGENTCPOINTS) return 0;     // (0xFF if never written)
+  a0=eeprom_read_word((const uint16_t *)(e+1)); 
+  p0=(int32_t)eeprom_read_dword((const uint32_t *)(e+3)); 
+  if (adc<=a0) return p0; 
+  for (i=1; i<n; i++)
+  {
+    e+=6; 
+    a1=eeprom_read_word((const uint16_t *)(e+1)); 
+    p1=(int32_t)eeprom_read_dword((const uint32_t *)(e+3)); 
+    if (adc<=a1) return p0+(p1-p0)*(long)(adc-a0)/(long)(a1-a0); 
+    a0=a1;  p0=p1; 
+  }
+  return p0; 
+}
+#endif  // FRQGENTEMPCOMP
+
+
+#if FRQGENPPS
+// GPS 1PPS.  Timer1 (or 3) counts the crystal clock and the input capture 
+// timestamps each pulse (32 bits with the overflow count).  The filter runs 
+// in 'ppsTimestamp' from the capture interrupt, once a second.  The stamps
+// are 32 bits and wrap (every 268s at 16MHz), so they are only subtracted.
+static uint32_t FGPpsLast;                  // Last timestamp
+static volatile long FGPpsEst;              // Estimate (ppb*16)
+static volatile byte FGPpsN;                // Good seconds averaged (to 255)
+static volatile byte FGPpsLocked;           // Last second was in the window
+static byte FGPpsHave;                      // FGPpsLast is valid
+
+#if !FRQGENHOST
+#if FRQGENPPS==3
+#define FGPPSTCCRA    TCCR3A            // Timer3, ICP3 is PC7 (Arduino pin 13)
+#define FGPPSTCCRB    TCCR3B
+#define FGPPSICR      ICR3
+#define FGPPSTIFR     TIFR3
+#define FGPPSTIMSK    TIMSK3
+#define FGPPSB        ((1<<ICNC3)|(1<<ICES3)|(1<<CS30))
+#define FGPPSF        ((1<<ICF3)|(1<<TOV3))
+#define FGPPSIE       ((1<<ICIE3)|(1<<TOIE3))
+#define FGPPSTOV      TOV3
+#define FGPPSDDR      DDRC
+#define FGPPSBIT      7
+#define FGPPS_CAPT_vect TIMER3_CAPT_vect
+#define FGPPS_OVF_vect  TIMER3_OVF_vect
+#else
+#define FGPPSTCCRA    TCCR1A            // Timer1, ICP1 is PD4 (Arduino pin 4)
+#define FGPPSTCCRB    TCCR1B
+#define FGPPSICR      ICR1
+#define FGPPSTIFR     TIFR1
+#define FGPPSTIMSK    TIMSK1
+#define FGPPSB        ((1<<ICNC1)|(1<<ICES1)|(1<<CS10))
+#define FGPPSF        ((1<<ICF1)|(1<<TOV1))
+#define FGPPSIE       ((1<<ICIE1)|(1<<TOIE1))
+#define FGPPSTOV      TOV1
+#define FGPPSDDR      DDRD
+#define FGPPSBIT      4
+#define FGPPS_CAPT_vect TIMER1_CAPT_vect
+#define FGPPS_OVF_vect  TIMER1_OVF_vect
+#endif
+static volatile unsigned FGPpsOvf;          // Timer overflows (top 16 bits)
+
+ISR(FGPPS_OVF_vect)
+  // Count the timer overflows (every 4ms at 16MHz).
+{
+  FGPpsOvf++; 
 }
 
+ISR(FGPPS_CAPT_vect)
+  // Timestamp the pulse.  If the timer overflowed just before the capture 
+  // (its interrupt hasn't run yet) the capture is in the next 65536 counts.
+{
+  unsigned icr=FGPPSICR, hi=FGPpsOvf; 
+  if ((FGPPSTIFR&(1<<FGPPSTOV)) && icr<0x8000) hi++; 
+  FrequencyGenerator::ppsTimestamp(((uint32_t)hi<<16)|icr); 
+}
+#endif  // !FRQGENHOST
+#endif  // FRQGENPPS
 
 
+#if 0
+byte _pin;
+FrequencyGenerator::FrequencyGenerator(int pin) { pinMode(pin, OUTPUT);  _pin = pin; }
+{
+  _FreqGenVal=0; _pin=10;
+}
+#endif
+
+long FrequencyGenerator::read(void)  
+  //  Return the current setting of the frequency generator.
+{ 
+  return _FreqGenVal; 
+}
+
+
+void FrequencyGenerator::cacheStats(unsigned long &Hits, unsigned long &Misses)
+  // Return the number of cache hits and misses since the last 'cacheClear'.
+{
+#if FRQGENCACHE
+  Hits=FGCacheHits;  Misses=FGCacheMisses; 
+#else
+  Hits=0;  Misses=0; 
+#endif
+}
+
+
+void FrequencyGenerator::cacheClear(void)
+  // Empty the plan cache and zero the hit and miss counts.
+{
+#if FRQGENCACHE
+  FGCacheN=0;  FGCacheHits=0;  FGCacheMisses=0; 
+#endif
+}
+
+
+void FrequencyGenerator::dither(bool On)
+  // Turn dithering on or off (on by default).  Only has an effect if 
+  // FRQGENDITHER is defined.  Takes effect on the next 'solve' or 'set'.
+{
+  _Dither=On; 
+}
+
+
+void FrequencyGenerator::setDuty(unsigned Permille)
+  // Set the duty cycle to 'Permille' (1/1000ths high, 500 by default).  If 
+  // the output is on only OCR4A (OCR4B) is written, the divisors are kept.
+  // (It loads at the next TOP, so the cycle now running isn't cut)
+{
+  _DutyK=FGDutyK(Permille); 
+#if !FRQGENHOST
+  unsigned ocr;  byte sreg; 
+  if (_FreqGenVal<=0L) return; 
+  ocr=FGOcr(_Plan.cnt,_DutyK); 
+  sreg=SREG;  cli(); 
+#if FRQGENSYNC
+  // (A plan still waiting for the interrupt gets it from FGSyncNext)
+  if (FGSyncPend&1) FGSyncNext.ocr=ocr;  else
+#endif
+  if (FGReg.on && ocr!=FGReg.ocr)
+  {
+#if FRQGENUSEPB6
+    TCNT4H /*upper OCR4B*/ =(ocr>>8);  OCR4B=(ocr&0xFF); 
+#else
+    TCNT4H /*upper OCR4A*/ =(ocr>>8);  OCR4A=(ocr&0xFF); 
+#endif
+  }
+  FGReg.ocr=ocr; 
+  SREG=sreg; 
+#endif
+}
+
+
+long FrequencyGenerator::set(long Freq, unsigned Permille)
+  // Same as 'set' but also set the duty cycle to 'Permille' (see 'setDuty').
+{
+  _DutyK=FGDutyK(Permille); 
+  return set(Freq); 
+}
+
+
+void FrequencyGenerator::setDutyResolution(unsigned Steps)
+  // Have 'solve' (and 'set') prefer plans with a count of at least 'Steps' 
+  // (0, no preference, by default) so the duty cycle can be set in finer 
+  // steps.  Of the best plans found ('solveTop') the one with the smallest
+  // error and a big enough count is used, or the biggest count if none are.
+{
+  FGCntMin=Steps; 
+#if FRQGENCACHE
+  FGCacheN=0;                         // (the cached plans may not have it)
+#endif
+}
+
+
+void FrequencyGenerator::mute()
+  // Hold the output low without stopping the timer or changing the plan.  
+  // Just disconnects the OC4x output (the pin then outputs its PORT bit).  
+{
+#if !FRQGENHOST
+  FGReg.mute=1; 
+  if (TCCR4A)                       // (only if the output is on, off keeps 
+  {                                 //  its pull-up and 'apply' clears it)
+    FRQGENPORT&=~(1<<FRQGENBIT); 
+    TCCR4A=FGPWM; 
+  }
+#endif
+}
+
+
+void FrequencyGenerator::unmute()
+  // Connect the output again after 'mute'.  The timer kept running, so the 
+  // output carries on in phase as if it had never stopped.
+{
+#if !FRQGENHOST
+  FGReg.mute=0; 
+  if (TCCR4A) TCCR4A=FGPWM|FGCOM; 
+#endif
+}
+
+
+void FrequencyGenerator::phase(Phase Ph)
+  // Set what happens to the output phase when the frequency changes 
+  // (PhaseAny by default).  
+{
+  _Phase=Ph; 
+}
+
+
+void FrequencyGenerator::sync(bool On)
+  // Turn changing the frequency at the end of a cycle on or off (on by 
+  // default).  Only has an effect if FRQGENSYNC is defined.  
+{
+  _Sync=On; 
+}
+
+
+bool FrequencyGenerator::pending()
+  // Return true if a plan 'apply' staged is still waiting for the end of a 
+  // cycle (for FRQGENSYNC).  
+{
+#if FRQGENSYNC && !FRQGENHOST
+  return FGSyncPend!=0; 
+#else
+  return false; 
+#endif
+}
+
+
+void FrequencyGenerator::wait()
+  // Wait until the plan 'apply' staged is being output (for FRQGENSYNC).  
+  // At most two cycles of the old frequency.  (Needs interrupts on)
+{
+  while (pending()) continue; 
+}
+
+
+void FrequencyGenerator::calibrate(long Ppb, bool Save)
+  // Set the crystal error to 'Ppb' parts per billion (positive if the clock 
+  // is fast) and save it in EEPROM if 'Save'.  The clock unit is worked out 
+  // here once (see FGSetCal), so the solver just multiplies by it.  
+  // Takes effect on the next 'solve' or 'set'.
+{
+  if (Ppb>FRQGENCALMAX) Ppb=FRQGENCALMAX; 
+  if (Ppb<-FRQGENCALMAX) Ppb=-FRQGENCALMAX; 
+  FGCalPpb=Ppb;  FGSetCal(); 
+#if !FRQGENHOST
+  if (Save)
+  {
+    eeprom_update_dword((uint32_t *)FRQGENEEADDR,(uint32_t)Ppb); 
+    eeprom_update_byte((uint8_t *)FRQGENEEADDR+4,FRQGENEESIG); 
+  }
+#else
+  (void)Save; 
+#endif
+}
+
+
+long FrequencyGenerator::calibration(void)
+  // Return the crystal error in ppb set by 'calibrate' (0 if not calibrated).
+{
+  return FGCalPpb; 
+}
+
+
+long FrequencyGenerator::tempComp(void)
+  // Do the next step of the temperature correction and return the correction
+  // now in use (ppb).  Call often (from loop()): it never waits.  Every 
+  // FRQGENTEMPMS it starts an ADC conversion of the temperature sensor, and 
+  // on the calls after that it checks for the conversion to finish.  The 
+  // first conversion after switching to the 2.56V reference is thrown away.
+  // When the correction from the table changes, the frequency last set is
+  // solved again and applied if its divisors have changed.
+{
+#if FRQGENTEMPCOMP && !FRQGENHOST
+  unsigned adc;  long p; 
+
+  if (!FGTcState)
+  {
+    if (millis()-FGTcTime<FRQGENTEMPMS) return FGTempPpb; 
+    FGTcTime=millis(); 
+    ADCSRB|=(1<<MUX5);  ADMUX=FRQGENTCMUX; 
+    ADCSRA|=(1<<ADEN)|(1<<ADSC);  FGTcState=1; 
+    return FGTempPpb; 
+  }
+  if (ADCSRA&(1<<ADSC)) return FGTempPpb;       // Still converting
+  adc=ADCL;  adc|=ADCH<<8;                      // (ADCL first)
+  // If something else (analogRead) used the ADC try again next time
+  if (ADMUX!=FRQGENTCMUX || !(ADCSRB&(1<<MUX5))) { FGTcState=0;  return FGTempPpb; }
+  if (FGTcState==1) { ADCSRA|=(1<<ADSC);  FGTcState=2;  return FGTempPpb; }
+  FGTcState=0;  FGTcAdc=adc; 
+  p=FGTempLookup(adc); 
+  if (p!=FGTempPpb) { FGTempPpb=p;  FGSetCal();  retune(); }
+#endif
+  return FGTempPpb; 
+}
+
+
+int FrequencyGenerator::temperature(void)
+  // Return the last temperature sensor reading (raw ADC), -1 if none yet.
+{
+#if FRQGENTEMPCOMP && !FRQGENHOST
+  return FGTcAdc; 
+#else
+  return -1; 
+#endif
+}
+
+
+void FrequencyGenerator::tempTable(byte N, const unsigned *Adc, const long *Ppb)
+  // Write the 'N' point temperature table ('Adc' readings in increasing 
+  // order and their corrections in 'Ppb') to EEPROM.  N=0 removes it.
+{
+#if FRQGENTEMPCOMP && !FRQGENHOST
+  byte *e=(byte *)FRQGENTCADDR,i; 
+  if (N>FRQGENTCPOINTS) N=FRQGENTCPOINTS; 
+  eeprom_update_byte(e,N); 
+  for (i=0; i<N; i++, e+=6)
+  {
+    eeprom_update_word((uint16_t *)(e+1),Adc[i]); 
+    eeprom_update_dword((uint32_t *)(e+3),(uint32_t)Ppb[i]); 
+  }
+  FGTcTime=millis()-FRQGENTEMPMS;     // (read the temperature again now)
+#else
+  (void)N;  (void)Adc;  (void)Ppb; 
+#endif
+}
+
+
+void FrequencyGenerator::pps(bool On)
+  // Start (or stop) using the GPS 1PPS input.  When stopped the correction 
+  // goes back to the calibration (and temperature correction).
+{
+#if FRQGENPPS
+#if !FRQGENHOST
+  FGPPSTIMSK=0;                     // (no interrupts while it changes)
+  if (On)
+  {
+    FGPPSDDR&=~(1<<FGPPSBIT);       // Input
+    FGPPSTCCRA=0;  FGPPSTCCRB=FGPPSB;   // Normal mode, clk/1, rising edge
+    FGPPSTIFR=FGPPSF;  FGPPSTIMSK=FGPPSIE; 
+  }
+  else FGPPSTCCRB=0; 
+#endif
+  FGPpsHave=0;  FGPpsN=0;  FGPpsLocked=0; 
+  if (!On && FGPpsOn) { FGPpsOn=0;  FGSetCal();  retune(); }
+#else
+  (void)On; 
+#endif
+}
+
+
+void FrequencyGenerator::ppsTimestamp(uint32_t T)
+  // Add the 1PPS timestamp 'T' (in crystal clocks) to the filter.  Called by
+  // the capture interrupt (or with recorded timestamps in a host build).  The 
+  // error of each second is the count less F_CPU.  A second that is way off 
+  // (a missed or extra pulse) restarts the average.  The estimate is an 
+  // average of the seconds: the first is taken as is and each one after 
+  // moves it 1/2^k of the way, k growing with the count to FRQGENPPSAVG.  
+  // Only adds and shifts, as this is an interrupt.  (The count is worked out
+  // in 32 bits, so it is right across a wrap of the timestamps on a PC too)
+{
+#if FRQGENPPS
+  long e=(int32_t)(T-FGPpsLast-(uint32_t)F_CPU), m;  byte k; 
+
+  FGPpsLast=T; 
+  if (!FGPpsHave) { FGPpsHave=1;  return; }
+  if (e>(long)FRQGENPPSMAXE || e<-(long)FRQGENPPSMAXE) 
+  { 
+    FGPpsN=0;  FGPpsLocked=0;  return; 
+  }
+  m=e*FGPPSK;                       // error (ppb*16)
+  if (!FGPpsN) FGPpsEst=m; 
+  else 
+  {
+    k=BitLen(FGPpsN);  if (k>FRQGENPPSAVG) k=FRQGENPPSAVG; 
+    FGPpsEst+=(m-FGPpsEst)>>k; 
+  }
+  FGPpsLocked=(FGPpsN>=(1<<FRQGENPPSAVG) && 
+               m-FGPpsEst<FRQGENPPSLOCK && FGPpsEst-m<FRQGENPPSLOCK); 
+  if (FGPpsN<255) FGPpsN++; 
+#else
+  (void)T; 
+#endif
+}
+
+
+byte FrequencyGenerator::ppsUpdate(void)
+  // Use the latest PPS estimate and return the lock state.  Call often (from
+  // loop()).  When the estimate has moved by FRQGENPPSSTEP ppb or more it 
+  // becomes the clock correction and the frequency last set is solved again
+  // (and applied if its divisors change).  This is outside the interrupt 
+  // as a solve takes much longer than a timestamp.
+{
+#if FRQGENPPS
+  long p;  byte n,lk; 
+#if !FRQGENHOST
+  byte sreg=SREG; 
+  cli();  p=FGPpsEst;  n=FGPpsN;  lk=FGPpsLocked; 
+  // No pulse for 2 seconds is no signal (the estimate is kept)
+  if ((unsigned)(FGPpsOvf-(unsigned)(FGPpsLast>>16))>(unsigned)((2*F_CPU)>>16)) n=0; 
+  SREG=sreg; 
+#else
+  p=FGPpsEst;  n=FGPpsN;  lk=FGPpsLocked; 
+#endif
+  if (!n) return 0; 
+  p=(p+8)>>4;                       // (ppb)
+  if (!FGPpsOn || p-FGPpsPpb>=FRQGENPPSSTEP || FGPpsPpb-p>=FRQGENPPSSTEP) 
+  {
+    FGPpsPpb=p;  FGPpsOn=1;  FGSetCal();  retune(); 
+  }
+  return (lk) ? 2 : 1; 
+#else
+  return 0; 
+#endif
+}
+
+
+long FrequencyGenerator::ppsPpb(void)
+  // Return the latest PPS estimate of the crystal error in ppb (0 if none).
+{
+#if FRQGENPPS
+  long p; 
+#if !FRQGENHOST
+  byte sreg=SREG; 
+  cli();  p=FGPpsEst;  SREG=sreg; 
+#else
+  p=FGPpsEst; 
+#endif
+  return (p+8)>>4; 
+#else
+  return 0; 
+#endif
+}
+
+
+void FrequencyGenerator::retune(void)
+  // The clock correction has changed, so solve the frequency last set by 
+  // 'set' (or 'setMilliHz', 'setPeriodNs') again and apply it if the 
+  // divisors are different.  Plans applied directly are left alone.
+{
+  Plan P;  byte m=_OutMode; 
+
+  if (!m || _Plan.freq<=0L) return; 
+  P=(m==3) ? solvePeriodNs(_OutF) : search(_OutF,m-1,_Policy); 
+  if (P.pll!=_Plan.pll || P.pdiv!=_Plan.pdiv || P.lg!=_Plan.lg || 
+      P.cnt!=_Plan.cnt || P.frac!=_Plan.frac || P.enh!=_Plan.enh) 
+  {
+    if (apply(P)>0L) _OutMode=m; 
+  }
+}
+
+
+void FrequencyGenerator::hiRes(bool On)
+  // Turn the high resolution (enhanced compare) mode on or off.  Takes effect 
+  // on the next 'solve' or 'set'.
+{
+  _HiRes=On; 
+}
+
+
+long FrequencyGenerator::set(long Freq)
+  // Set Timer4 to the frequency specified by 'Freq' (if 'Freq' > 0), shut off 
+  // frequency generator (if 'Freq' is 0) or return current frequency (if 'Freq'
+  // < 0).  Output the frequency on PC6 (Arduino pin 5) or alternatively on PB6 
+  // (Arduino pin 10). 
+  // NOTE: Frequency output may not match specified frequency but will be as 
+  // close to it as is possible for the system clock speed.  Max frequency is 
+  // crystal clock rate.  
+  // Function returns current frequency if ok or -1 if unable to set to the 
+  // desired frequency. 
+{
+  long f; 
+  if (Freq<0L) return _FreqGenVal; 
+  f=apply(solve(Freq)); 
+  if (f>0L) { _OutF=Freq;  _OutMode=1; }    // (for 'retune')
+  return f; 
+}
+
+
+long FrequencyGenerator::set(long Freq, Phase Ph)
+  // Same as 'set' but with phase mode 'Ph' for this change only.
+{
+  byte p=_Phase;  long f; 
+  _Phase=Ph;  f=set(Freq);  _Phase=p; 
+  return f; 
+}
+
+
+long FrequencyGenerator::setMilliHz(long mHz)
+  // Same as 'set' but 'mHz' is the frequency in milli-Hertz (up to 1MHz). 
+  // Returns the exact frequency now being output in mHz, 0 if off or -1 if 
+  // unable to set the frequency.  ('mHz' < 0 returns the current frequency)
+{
+  if (mHz<0L) return readMilliHz(); 
+  if (apply(solveMilliHz(mHz))<0L) return -1; 
+  if (_Plan.freq>0L) { _OutF=mHz;  _OutMode=2; }
+  return readMilliHz(); 
+}
+
+
+long FrequencyGenerator::readMilliHz(void)
+  // Return the current frequency in mHz. 
+{
+  return milliHz(_Plan); 
+}
+
+
+long FrequencyGenerator::milliHz(const Plan &P)
+  // Return the frequency plan 'P' outputs in mHz (rounded), 0 if off or -1 if 
+  // not valid.  This is 3 times the clock (times 2 in enhanced mode) over 3 
+  // times the prescaler times the count, worked out a decimal digit at a time
+  // (FGMilli) so no 64 bit math is needed.  For a dithered plan this is the 
+  // average frequency.
+{
+  if (P.freq<=0L) return P.freq; 
+  // (A dithered count is cnt+frac/65536, so use the count times 65536)
+  if (P.frac) 
+    return FGMilli(FGClock3(P)<<P.enh,3UL*(((unsigned long)P.cnt<<16)|P.frac),
+                   16-P.lg); 
+  return FGMilli(FGClock3(P)<<P.enh,3UL*P.cnt<<P.lg,0); 
+}
+
+
+long FrequencyGenerator::setPeriodNs(unsigned long Ns)
+  // Set the output to the period 'Ns' in nanoseconds (0 turns it off).  
+  // Returns the period now being output in ns or -1 if it can't be made.
+{
+  if (!Ns) return apply(solve(0)); 
+  if (apply(solvePeriodNs(Ns))<0L) return -1; 
+  _OutF=Ns;  _OutMode=3; 
+  return readPeriodNs(); 
+}
+
+
+long FrequencyGenerator::readPeriodNs(void)
+  // Return the current period in ns (0 if off).
+{
+  return periodNs(_Plan); 
+}
+
+
+long FrequencyGenerator::periodNs(const Plan &P)
+  // Return the period of plan 'P' in ns (rounded), 0 if off, -1 if not valid.
+  // The period is 3*PS*cnt*1e9/(3 times the clock).  With the count in 
+  // 1/65536 counts (a dithered count is cnt+frac/65536) and 1e9/65536 being 
+  // 5^9/2^7 this is N*5^9*2^(lg-7)/D (N=3*cnt*65536, D=3*clock), worked out 
+  // a digit (base 5) at a time as in FGMilli, so the clock may be any number
+  // of Hz (calibrated).
+{
+  unsigned long N,D,q,r;  byte i; 
+
+  if (P.freq<=0L) return P.freq; 
+  N=3*(((unsigned long)P.cnt<<16)|P.frac);  D=FGClock3(P)<<P.enh; 
+  q=N/D;  r=N%D; 
+  for (i=0; i<9; i++) { r*=5;  q=q*5+r/D;  r%=D; }
+  if (P.lg<7) return (q+(1UL<<(6-P.lg)))>>(7-P.lg);   // (r can't change it)
+  for (i=7; i<P.lg; i++) { r<<=1;  q<<=1;  if (r>=D) { r-=D;  q|=1; } }
+  if (r*2>=D) q++;                    // round 
+  return q; 
+}
+
+
+FrequencyGenerator::Plan FrequencyGenerator::solvePeriodNs(unsigned long Ns)
+  // Calculate the plan with the period closest to 'Ns' nanoseconds.  This 
+  // works in the time domain: the error is |PS*cnt*1e9 - Ns*clock| (times 3,
+  // as FGClock3) over the clock, so the period error is what is made 
+  // smallest.  The count is estimated by multiplying by 2^60/3e9 (instead of 
+  // dividing by 3e9) and the counts either side are checked exactly.  The 
+  // 64 bit numbers are kept as two longs (high and low) and multiplied with 
+  // FGMulHL, so no long long math or divides are used to find the counts and
+  // prescalers (a candidate takes 3 of those multiplies).
+{
+  Plan P={0,0,_HiRes,0xA,0,-1L,0}, T=P;  
+  unsigned long C3,c,c0,X;  uint32_t Sh,Sl,Eh,El,Ah,Al,Bh,Bl,svEh=0,svEl=0; 
+  unsigned cmin=4<<P.enh, cmax=0x3FF|(P.enh<<10);  byte i,l,lg,w,svW=0; 
+
+  if (!Ns) return P; 
+#if FRQGENNOUSB
+  for (i=0; i<FGNUMCLOCKS; i++)
+  {
+    w=pgm_read_byte(&FGClocks[i].ck); 
+    T.pll=pgm_read_byte(&FGClocks[i].frq)>>4;  T.pdiv=pgm_read_byte(&FGClocks[i].frq)&0xF;
+#else
+  for (i=0; i<sizeof(CKM); i++)
+  {
+    if (i==1) continue;               // (96MHz can't be used)
+    w=CKM[i];  T.pll=i; 
+#endif
+    C3=FGClock3(T);                   // 3 times clock
+    // S (Sh:Sl) is the period in 1/(3e9*clock) seconds, X the period in 
+    // counts (S/3e9, within a count)
+    Sh=FGMulHL(Ns,C3,Sl); 
+    if (P.enh) { Sh=(Sh<<1)|(Sl>>31);  Sl<<=1; }
+    X=FGMulHL((Sh<<3)|(Sl>>29),384307168UL,Al);   // (S>>29)*(2^60/3e9)>>31 
+    X=(X<<1)|(Al>>31); 
+    lg=BitLen(X>>(10+P.enh));  if (X>>(25+P.enh)) lg=15; 
+    for (l=lg; l<=lg+1 && l<15; l++)
+    {
+      c0=X>>l; 
+      for (c=(c0 ? c0-1 : 0); c<=c0+1; c++)
+      {
+        if (c<cmin || c>cmax) continue; 
+        // E=|3e9*c*2^l-S|
+        Eh=FGMulHL(3000000000UL,c,El); 
+        if (l) { Eh=(Eh<<l)|(El>>(32-l));  El<<=l; }
+        if (Eh>Sh || (Eh==Sh && El>=Sl)) { Eh-=Sh+(El<Sl);  El-=Sl; }
+        else { Eh=Sh-Eh-(Sl<El);  El=Sl-El; }
+        // Keep it if E/w is smaller than the best (cross multiply)
+        Ah=FGMulHL(El,svW,Al)+Eh*svW;  Bh=FGMulHL(svEl,w,Bl)+svEh*w; 
+        if (!svW || Ah<Bh || (Ah==Bh && Al<Bl)) 
+        { 
+          P=T;  P.lg=l;  P.cnt=c;  svEh=Eh;  svEl=El;  svW=w;  P.freq=0; 
+        }
+      }
+    }
+  }
+  if (svW) P.freq=(((FGClock3(P)<<(1+P.enh))/((3UL*P.cnt)<<P.lg))+1)/2; 
+  else P.freq=-1; 
+  return P; 
+}
+
+
+long FrequencyGenerator::stepUp(void)
+  // Move to the next higher frequency that can be made.  Returns the new 
+  // frequency or -1 if there isn't one (or the generator is off). 
+{
+  return step(1); 
+}
+
+
+long FrequencyGenerator::stepDown(void)
+  // Move to the next lower frequency that can be made.  Returns the new 
+  // frequency or -1 if there isn't one (or the generator is off). 
+{
+  return step(0); 
+}
+
+
+long FrequencyGenerator::step(byte Up)
+  // Do 'stepUp' (Up=1) or 'stepDown' (Up=0) from the last plan applied.  
+{
+  Plan N; 
+  if (_Plan.freq<=0L || !FGStep(N,_Plan,Up)) return -1; 
+  return apply(N); 
+}
+
+
+unsigned long FrequencyGenerator::reachable(long Lo, long Hi, 
+                                           void (*Fn)(const Plan &P))
+  // Call 'Fn' (if not NULL) with the plan of every frequency that can be made
+  // from 'Lo' to 'Hi' Hz (the plan's rounded 'freq'), lowest first, and 
+  // return how many there are.  Each exact frequency is given once (a 
+  // frequency that several pll/prescaler/count settings make is only the 
+  // first of them).  Starts with one 'solve' then does one step (FGStep) per
+  // frequency, so the time goes with the number found and not the width of 
+  // the range.  The hardware is not changed.
+{
+  Plan P,N;  byte d=_Dither;  unsigned long n=0; 
+
+  if (Lo<1L) Lo=1; 
+  if (Hi<Lo) return 0; 
+  _Dither=0;  P=solve(Lo);  _Dither=d;          // (an undithered plan)
+  if (P.freq<0L) return 0; 
+  // The closest plan to Lo may be above it, so step down to the first one 
+  // that rounds to Lo or more, or up if it is below Lo.
+  while (FGStep(N,P,0) && N.freq>=Lo) P=N; 
+  while (P.freq<Lo) { if (!FGStep(N,P,1)) return 0;  P=N; }
+  while (P.freq<=Hi)
+  {
+    n++;  if (Fn) Fn(P); 
+    if (!FGStep(N,P,1)) break; 
+    P=N; 
+  }
+  return n; 
+}
+
+
+long FrequencyGenerator::nearestExact(long Freq, Plan &P)
+  // Set 'P' to the plan for the frequency closest to 'Freq' that is exactly a
+  // whole number of Hertz (the clock divides by PS*cnt with no remainder) and
+  // return that frequency (-1 if none, 0 if 'Freq' is 0).  
+  // Each clock is 2^A*3^B*5^C*(the rest), so the exact divisors are 
+  // 2^a*3^b*5^c.  For each 3^b*5^c only the two powers of 2 that put the 
+  // frequency either side of 'Freq' are tried, so this is at most a few 
+  // dozen tries for each clock.  The divisor is split into the smallest 
+  // prescaler that keeps the count in range and the count.
+{
+  Plan T={0,0,_HiRes,0xA,0,-1L,0};  unsigned long N,M,d,f,e,svE=0xFFFFFFFFUL,b3,base; 
+  byte i,a,k,A,B,C,b,c,lg;  unsigned cmin=4<<T.enh, cmax=0x3FF|(T.enh<<10); 
+
+  P=T; 
+  if (Freq<0L) return -1; 
+  if (!Freq) { P.freq=0;  return 0; }
+#if FRQGENNOUSB
+  byte ck,frq; 
+  for (i=0; i<FGNUMCLOCKS; i++)
+  {
+    // (Clocks that aren't a whole number of Hz can't give a whole frequency)
+    ck=pgm_read_byte(&FGClocks[i].ck);  if (ck%3) continue; 
+    frq=pgm_read_byte(&FGClocks[i].frq);  T.pll=frq>>4;  T.pdiv=frq&0xF; 
+    N=(ck/3)*4000000UL; 
+#else
+  for (i=0; i<sizeof(CKM); i++)
+  {
+    if (i==1) continue;               // (96MHz can't be used)
+    T.pll=i;  N=F_CPU*CKM[i]; 
+#endif
+    N<<=T.enh;                        // (counts are half counts if enhanced)
+    // Factor the clock
+    for (M=N, A=0; !(M&1); M>>=1) A++; 
+    for (B=0; !(M%3); M/=3) B++; 
+    for (C=0; !(M%5); M/=5) C++; 
+    for (b=0, b3=1; b<=B; b++, b3*=3)
+    {
+      for (c=0, base=b3; c<=C; c++, base*=5)
+      {
+        // 2^a is the biggest power of 2 with base*2^a <= N/Freq (frequency 
+        // at or above 'Freq') and a+1 gives the next one below it.
+        M=N/base/Freq; 
+        a=(M) ? BitLen(M)-1 : 0; 
+        if (a>A) a=A;                 // (only A twos to use)
+        for (k=0; k<2 && a<=A; k++, a++)
+        {
+          d=base<<a;  f=N/d; 
+          for (lg=0; lg<a && lg<14 && (d>>lg)>cmax; lg++) continue; 
+          if ((d>>lg)<cmin || (d>>lg)>cmax) continue; 
+          e=(f>(unsigned long)Freq) ? f-Freq : Freq-f; 
+          if (e<svE) { svE=e;  P=T;  P.lg=lg;  P.cnt=d>>lg;  P.freq=f; }
+        }
+      }
+    }
+  }
+  return P.freq; 
+}
+
+
+FrequencyGenerator::Plan FrequencyGenerator::solve(long Freq)
+  // Calculate the PLL, prescaler and count values that will produce the 
+  // frequency closest to 'Freq' without touching the hardware.  If 'Freq' is
+  // 0 the plan returned turns the generator off.  If no divisors can be found
+  // (or 'Freq' < 0) the plan's 'freq' member is -1.
+{
+  return solve(Freq,(Policy)_Policy); 
+}
+
+
+FrequencyGenerator::Plan FrequencyGenerator::solve(long Freq, Policy Pol)
+  // Same as 'solve' but with policy 'Pol' for this search only.
+{
+  _Last=search(Freq,0,Pol);  _LastF=Freq;  _LastMilli=0; 
+  return _Last; 
+}
+
+
+byte FrequencyGenerator::solveTop(long Freq, Plan *Top, byte K)
+  // Set 'Top' to the best (up to) 'K' plans for 'Freq' Hz, best first, and 
+  // return how many there are.  This is the list the policy picks from, so 
+  // it costs the same as a 'solve' (with no stop on an exact frequency).  
+  // The plans are not dithered.
+{
+  byte i; 
+  search(Freq,0,FGPOLALL); 
+  for (i=0; i<K && i<FGTopN; i++) 
+  {
+    Top[i].enh=_HiRes;  Top[i].frac=0;  FGTopPlan(Top[i],i); 
+  }
+  return i; 
+}
+
+
+void FrequencyGenerator::policy(Policy Pol)
+  // Set the policy 'solve' and 'set' use to pick between plans with the same
+  // error (MinError by default).
+{
+  _Policy=Pol; 
+}
+
+
+FrequencyGenerator::Plan FrequencyGenerator::solveMilliHz(long mHz)
+  // Same as 'solve' but 'mHz' is in milli-Hertz (up to 1MHz).
+{
+  if (mHz>1000000000L) mHz=-1;      // Too big for the math (and mHz is silly)
+  _Last=search(mHz,1,_Policy);  _LastF=mHz;  _LastMilli=1; 
+  return _Last; 
+}
+
+
+FrequencyGenerator::Result FrequencyGenerator::lastResult(void)
+  // Return the details of the last 'solve' (or 'set', 'solveMilliHz', 
+  // 'setMilliHz').  The search only saves its plan and the frequency asked 
+  // for, and the rest is worked out here so it costs 'set' nothing.  
+  // The error is (f-F)/F = (A-T*B)/(T*B) with A=1000*(3*clock)*2^(16-lg), 
+  // B=3*(cnt*65536+frac) and T the frequency asked for in mHz, all exact in 
+  // 64 bits (with multiplies only) and then FGPpb does the one divide.
+{
+  Result R={0,0,0,0,0,0,0,0,0,0,0}; 
+  unsigned long long A,B,E;  unsigned long u; 
+
+  if (_Last.freq<=0L) return R; 
+  R.pllsel=_Last.pll;  R.pdiv=_Last.pdiv;  R.ps=1<<_Last.lg;  R.ocr=_Last.cnt-1; 
+  R.enh=_Last.enh;  R.frac=_Last.frac; 
+  // The multiplier is 3 times the clock (in clock units) over 3*F_CPU
+  u=(unsigned long)FGUnits3(_Last)*(FGQNOM>>FGQSH); 
+  if (!(u%(3UL*F_CPU))) R.mul=u/(3UL*F_CPU); 
+  R.clock=(FGClock3(_Last)+1)/3; 
+  // Exact frequency of the count (3 times the clock over 3*PS*cnt), with 
+  // the common factors of 2 and 3 taken out
+  R.num=FGClock3(_Last)<<_Last.enh;  R.den=(3UL*_Last.cnt)<<_Last.lg; 
+  while (!(R.num&1) && !(R.den&1)) { R.num>>=1;  R.den>>=1; }
+  if (!(R.num%3)) { R.num/=3;  R.den/=3; }
+  // Error in ppb
+  // (3 times the clock is m*FGCalQ/2^FGQSH, which may not be a whole number)
+  A=(((unsigned long long)FGUnits3(_Last)*FGCalQ<<_Last.enh<<(16-_Last.lg))*125)
+    >>(FGQSH-3); 
+  B=(3*(((unsigned long long)_Last.cnt<<16)|_Last.frac))*
+    ((_LastMilli) ? (unsigned long)_LastF : _LastF*1000ULL); 
+  if (A>=B) { E=A-B;  R.ppb=FGPpb(E,B); }
+  else      { E=B-A;  R.ppb=-FGPpb(E,B); }
+  return R; 
+}
+
+
+FrequencyGenerator::Plan FrequencyGenerator::search(long Freq, byte Milli, 
+                                                   byte Pol)
+  // Do the divisor search for 'solve' (Milli=0) or 'solveMilliHz' (Milli=1, 
+  // where 'Freq' is in mHz).  For mHz the clock is multiplied by 1000 (as a
+  // clock/1024 and its low 10 bits, see FGCount) and the search is the same.
+  // The best candidates are kept in FGTop and policy 'Pol' picks from them 
+  // (Pol=FGPOLALL finds all of them for 'solveTop').
+{
+  byte lg,lg0,i,lgF,enh=_HiRes;  unsigned cnt,Nlo;  unsigned long A,err;
+  Plan P={0,0,enh,0xA,0,-1L,0};
+
+  FGTopN=0;                           // (no candidates if it returns early)
+  if (Freq<0L) return P; 
+  if (!Freq) { P.freq=0; return P; }
+#if FRQGENCACHE
+  // Skip the search if the frequency (for the same mode) was solved recently
+  // (not for KeepPll, which depends on the current plan)
+  byte key=Milli|(enh<<1)|(_Dither<<2)|(Pol<<3); 
+  if (Pol<KeepPll && FGCacheGet(Freq,key,P)) return P; 
+#endif
+#if FRQGENNOUSB
+  // Try every clock in FGClocks.  Work with 3 times the clock (and so 3 times
+  // the frequency) so that all of the clocks are whole numbers.  
+  byte ck,frq;  unsigned long B;
+  if (!Milli && Freq>F_CPU*4) goto NOTFOUND;       // Above the fastest clock
+  B=(unsigned long)Freq*3;  lgF=BitLen(B);      // (up to 3e9 in mHz)
+  for (i=0; i<FGNUMCLOCKS; i++)
+  {
+    ck=pgm_read_byte(&FGClocks[i].ck);  A=FGSplit(ck,Milli,Nlo);  // 3 times clock
+    // Find the prescaler.  If it is out of range, ignore this CLK value
+    lg=LgOf(A,B,lgF); 
+    if (lg > 14) continue;              
+    lg0=lg;  cnt=FGCount(A,Nlo,B<<lg,lg,enh,err); 
+    if (!cnt) continue; 
+    // The error is relative to the clock (like dividing by the pll scale when
+    // using the USB clocks) so candidates are compared by err/ck.  Multiply 
+    // instead of divide (err can be big in mHz so use long long).
+#if FRQGENDEBUG
+    printfROM("CLK=%ldK  Frq=%02X PS=%-5d Cnt=%-4d Freq=%-8ld Er=%ld\n",
+              (ck*4000L/3),pgm_read_byte(&FGClocks[i].frq),(1<<lg) ,cnt, 
+              (((ck*4000000UL<<(1+enh))/(3L*(1<<lg)*(long)cnt))+1)/2, err/ck); 
+#endif
+    frq=pgm_read_byte(&FGClocks[i].frq); 
+    FGTopAdd(err,ck,frq>>4,frq&0xF,lg,cnt,lg!=lg0); 
+    // Nothing can beat an error of 0, so stop looking if we have one (unless 
+    // the policy needs the ties, or the count was moved up and a later clock
+    // may tie it). 
+    if (!err && Pol==MinError && cnt>=FGCntMin && lg==lg0) break; 
+  }
+  if (FGTopN)
+  {
+    // Take the policy's pick and calculate the actual frequency output 
+    // (rounded, as below)
+    FGTopPlan(P,FGTopPick(Pol,_Plan));
+#if FRQGENDEBUG
+    printfROM("Selectd: Pll=%d Pdiv=%d PS=%-5d Cnt=%-4d Freq=%-8ld\n",
+              P.pll,P.pdiv,(1<<P.lg),P.cnt,P.freq);  
+#endif
+  }
+NOTFOUND: 
+#else 
+  byte pll,lo8,hi8;  unsigned lgs=0;  unsigned long dif;
+  lgF=0; 
+  if (!Milli && FGCalQ==FGQNOM)
+  {
+    // Binary search the band table for the first band whose top is >= Freq
+    // to get the prescaler for each pll.  (6 probes)  The table is built 
+    // for the nominal clock so it isn't used if the clock is calibrated.
+    // Worst case for the whole search is then 6 table probes plus, for each 
+    // of the 3 clocks, one 11 (12 in enhanced mode) step division and at most
+    // one prescaler bump (a few shifts).
+    lo8=0;  hi8=FGNUMBANDS-1; 
+    while (lo8<hi8)
+    {
+      i=(lo8+hi8)/2; 
+      if ((long)pgm_read_dword(&FGBands[i].top)<Freq) lo8=i+1; else hi8=i; 
+    }
+    lgs=pgm_read_word(&FGBands[lo8].lgs); 
+  }
+  else lgF=BitLen(Freq); 
+  for (pll=0; pll<sizeof(CKM); pll++, lgs>>=4)
+  {
+    // Clock for this pll setting (clock/1024 and the low bits, see FGSplit)
+    A=FGSplit(CKM[pll],Milli,Nlo); 
+    // Get the prescaler from the band table (Hz) or from the bit lengths
+    // (mHz, or a calibrated clock, where the table can't be used).
+    // If pll==1 (96MHz) then ignore this PLL value (counter can't run @96MHz)
+    //   (The table always has lg=15 for it).
+    // If the lg2 is out of range of prescaler, ignore this CLK value
+    if (!lgF) lg=lgs&0xF; 
+    else 
+    { 
+      if (pll==1) continue; 
+      lg=LgOf(A,Freq,lgF); 
+    }
+    if (lg > 14) continue;              
+    // Get the count for this clock and prescaler.  
+    lg0=lg;  cnt=FGCount(A,Nlo,(unsigned long)Freq<<lg,lg,enh,err); 
+    if (!cnt) continue; 
+    // Divide the difference between the desired frequency and the actual 
+    // frequency by the pll scale (with shifts for 4 and 3).  The resultant 
+    // integer is the difference in lots of counts (eg the most precision we
+    // can do with ints).  Save/compare this integer value to figure out which
+    // setting is the closest to the desired frequency.
+    dif=err;  if (CKM[pll]==4) dif>>=2;  else if (CKM[pll]==3) dif=DivU3(dif);
+#if FRQGENDEBUG
+    printfROM("CLK=%dM  Pll=%d PS=%-5d Cnt=%-4d Freq=%-8ld Er=%ld\n",
+              (int)(F_CPU/1000000*CKM[pll]), pll,(1<<lg) ,cnt, 
+              ((((F_CPU*CKM[pll])<<(1+enh))/((long)(1<<lg)*(long)cnt))+1)/2, dif); // CKM[pll]);
+#endif
+    // Keep these settings in the list of the best ones (in order of error).
+    // Which of the ones with the same error is used is up to the policy.
+    FGTopAdd(dif,CKM[pll],pll,0xA,lg,cnt,lg!=lg0); 
+    // Nothing can beat an error of 0, so stop looking if we have one (unless 
+    // the policy needs the ties, or the count was moved up and a later clock
+    // may tie it). 
+    if (!dif && Pol==MinError && cnt>=FGCntMin && lg==lg0) break; 
+  }
+  if (FGTopN)
+  {
+    // Take the policy's pick (see FGTopPick)
+    // Calculate the actual frequency output
+    //   For integer frequency Mult clk *2 then do calc, then add 1, then 
+    //   div 2. This gives an output frequency that is (Freq+0.5) then trunc 
+    //   to whole number.   
+    //   This makes 0.51 output a 1. (eg. an integer "round" function)
+    //   (Mult by 4 in enhanced mode as the count is in half counts)
+    FGTopPlan(P,FGTopPick(Pol,_Plan));
+#if FRQGENDEBUG
+    printfROM("Selectd: Pll=%d PS=%-5d Cnt=%-4d Freq=%-8ld\n",
+              P.pll,(1<<P.lg),P.cnt,P.freq);  
+#endif
+  }
+#endif  // FRQGENNOUSB
+#if FRQGENDITHER
+  // Work out the dither fraction if dithering is on and the frequency is low
+  // enough for the ISR.  (The ratio is found here once, not in the ISR)
+  if (_Dither && P.freq>0L && P.freq<=FRQGENDITHERMAX) 
+  {
+    FGDither(P,Freq,Milli); 
+#if FRQGENDEBUG
+    printfROM("Dither:  Cnt=%-4d Frac=%u/65536 Freq=%-8ld\n",P.cnt,P.frac,P.freq);
+#endif
+  }
+#endif
+#if FRQGENDEBUG
+  if (P.freq<0)  // We never found a valid set of divisors
+    printfROM(" ***  No divisors found  ***\n");   
+#endif
+#if FRQGENCACHE
+  if (Pol<KeepPll) FGCachePut(Freq,key,P); 
+#endif
+  return P; 
+}
+
+
+long FrequencyGenerator::applyFromISR(const Plan &P)
+  // Same as 'apply' but for use in an interrupt routine, with a plan solved 
+  // before.  Only changes a running output to another frequency: returns -1
+  // and changes nothing if the output is off (or being turned on by 'apply'),
+  // 'P' would turn it off or isn't valid, or (FRQGENNOUSB) 'P' needs a new 
+  // PLL frequency, which waits for the PLL to lock.  
+{
+#if !FRQGENHOST
+  long f; 
+  if (P.freq<=0L || !FGReg.on) return -1; 
+#if FRQGENNOUSB
+  if (P.pdiv && (PLLFRQ&0x0F)!=P.pdiv) return -1; 
+#endif
+#if FRQGENDEBUG
+  FGQuiet=1;  f=apply(P);  FGQuiet=0; 
+#else
+  f=apply(P); 
+#endif
+  return f; 
+#else
+  return P.freq>0L ? apply(P) : -1; 
+#endif
+}
+
+
+long FrequencyGenerator::apply(const Plan &P)
+  // Write the values in plan 'P' to the Timer4 and PLL registers.  Returns 
+  // the frequency now being output (0 if off) or -1 if 'P' is not a valid 
+  // plan (in which case the hardware is not changed).  Only the registers 
+  // that are different from the last plan are written (see FGReg), so a 
+  // change of count alone is just the OCR4C and OCR4A (OCR4B) writes.  
+  // Interrupts are off while the registers are written (not while solving 
+  // or working out the values to write), so an interrupt can't change TC4H 
+  // between the two bytes of a 10 bit register, or call 'applyFromISR' part 
+  // way through.
+{
+#if !FRQGENHOST
+  unsigned cnt=0,ocr=0;  unsigned long k=0;  byte r,on,sreg; 
+#if FRQGENDEBUG
+  byte sk=0;                            // (register writes skipped)
+#define FGSKIP()      sk++
+#else
+#define FGSKIP()      ((void)0)
+#endif
+#endif
+
+  if (P.freq<0L) return -1; 
+  // Check the divisors too (a plan made by hand, or corrupted) so nothing 
+  // silly is written: OCR4C is 10 bits (11 in enhanced mode) and at least 3
+  // (as for the solver) and TCCR4B takes a prescaler of up to 2^14.  (PLL 
+  // select 1 is the PLL itself, too fast for the timer above 64MHz, so with
+  // FRQGENNOUSB only up to PDIV 6 and never at the USB 96MHz)
+  if (P.freq>0L && (P.enh>1 || P.cnt<(4U<<P.enh) || P.cnt>(0x400U<<P.enh) || 
+      P.lg>14 || P.pll>3 || 
+#if FRQGENNOUSB
+      (P.pdiv && (P.pdiv<3 || P.pdiv>0xA)) || (P.pll==1 && P.pdiv>6)
+#else
+      P.pll==1
+#endif
+     )) return -1; 
+#if !FRQGENHOST
+  if (P.freq>0L) 
+  {
+    cnt=P.cnt-1;  // Dont forget to subtract 1 from the count loaded into OCR4C !!
+    ocr=FGOcr(P.cnt,_DutyK);  // OCR4A/B for the duty cycle, (1/2 of cnt)-1 for 50%
+    // For PhaseContinuous the new period over the old in counts (an 
+    // 'applyFromISR' before cli() below could make this a plan old, which 
+    // only costs that change its phase)
+    if (_Phase==PhaseContinuous && FGReg.on) 
+      k=FGRatio12(P.cnt>>P.enh,(FGReg.top+1)>>FGReg.enh); 
+  }
+  sreg=SREG;  cli();  on=FGReg.on; 
+#endif
+#if FRQGENSYNC && !FRQGENHOST
+  // If the output is running, both frequencies are low enough for the 
+  // interrupt and only the counts change (the same PLL clock, prescaler and 
+  // enhanced mode) stage the plan for the overflow interrupt to commit at 
+  // the end of a cycle (see 'sync').  The clock and prescaler take effect as
+  // they are written, not at TOP, so a plan that changes them is written at 
+  // once as usual.
+#if FRQGENNOUSB
+  r = 0x40 | ((P.pll&3)<<4) | (PLLFRQ&0x0F); 
+#else
+  r = 0x4A | ((P.pll&3)<<4); 
+#endif
+  if (_Sync && !_Phase && on && _FreqGenVal<=FRQGENSYNCMAX && P.freq>0L && P.freq<=FRQGENSYNCMAX
+      && r==FGReg.pllfrq && ((P.lg+1)&0xF)==FGReg.tccr4b && P.enh==FGReg.enh
+#if FRQGENNOUSB
+      && (!P.pdiv || (PLLFRQ&0x0F)==P.pdiv)
+#endif
+     )
+  {
+    _FreqGenVal=P.freq;  _Plan=P;  _OutMode=0; 
+    FGSyncNext.top=cnt;  FGSyncNext.ocr=ocr;  FGSyncNext.frac=P.frac; 
+    // (If the interrupt is off its flag is stale, start at the next TOP)
+    if (!(TIMSK4&(1<<TOIE4))) TIFR4=(1<<TOV4); 
+    FGSyncPend|=1;  TIMSK4|=(1<<TOIE4); 
+    FGReg.top=cnt;  FGReg.ocr=ocr;  FGReg.dith=1; 
+    SREG=sreg; 
+#if FRQGENDEBUG
+    printfROM("apply: staged for the next TOP\n"); 
+#endif
+    return _FreqGenVal; 
+  }
+#endif
+  _FreqGenVal=P.freq;  _Plan=P;  _OutMode=0; 
+#if !FRQGENHOST
+#if FRQGENDITHER || FRQGENSYNC
+  // Stop dithering while the registers change (the ISR writes TC4H, OCR4C)
+  TIMSK4&=~(1<<TOIE4); 
+#endif
+#if FRQGENSYNC
+  // Drop any plan still waiting for the interrupt (it may have only written 
+  // part of it, so write all of the registers)
+  if (FGSyncPend) { FGSyncPend=0;  on=0; }
+#endif
+  //
+  // Now _FreqGenVal is 0 for turn off or >0 for set new frequency
+  // Set the timer registers to the values in the plan
+  //
+  if (!_FreqGenVal)     // Turn off, shut down timer.
+  {
+    // Shut off timer (if it's running) and release the IO 
+    TCCR4D=0;                           // Reset this to 0 (init() set it for PWM mode)
+    TCCR4A=0; TCCR4B=0;                 // Shut down the timer
+    // turn off the IO bits (input with pullup)
+    FRQGENDDR&=~(1<<FRQGENBIT);  FRQGENPORT|=(1<<FRQGENBIT);
+    FGReg.on=0;                         // (write all of them next time)
+    SREG=sreg; 
+#if FRQGENDEBUG
+    printfROM("Generator off\n"); 
+#endif
+  }
+  else    // *****  Now set up the timer to the values in the plan  *****
+  {
+#if FRQGENDEBUG
+    FGCYCSTART(); 
+#endif
+    // If the timer was off (or the first time) set the mode and the IO bits
+    // as needed for output.  Also set TCCR4A.  Otherwise they are already set.
+    if (!on)
+    {
+      TCCR4D=0;                         // Reset this to 0 (init() set it for PWM mode)
+      if (FGReg.mute) FRQGENPORT&=~(1<<FRQGENBIT);   // (held low, see 'mute')
+      FRQGENDDR|=(1<<FRQGENBIT);
+      // Toggle on compare match (COMP A out, or COMP B for PB6) unless muted
+      TCCR4A = FGReg.mute ? FGPWM : (FGPWM|FGCOM);  
+    }
+    // Note: When just powering up module (no code download) then PLLFRQ is 
+    // PDIV3:0=48MHz and PLLUSB=0 (/1).  After downloading code then PLLFRQ 
+    // is PDIV3:0=96MHz and PLLUSB=1 (/2)  This causes all frequencies that 
+    // use PLLFRQ to be 1/2 of expected values (if no code download).  
+    //PLLFRQ=(PLLFRQ & ~(0x30))|((cpll&3)<<4); // Set PLLFRQ to input clock we want.
+    // Use this instead... (force 96MHz /2 mode)
+#if FRQGENNOUSB
+    // Change the PLL frequency if the plan uses a different one.  Stop the 
+    // timer and take it off the PLL, turn the PLL off, set the new frequency,
+    // turn the PLL back on and wait for it to lock before the timer uses it.
+    // (pdiv is 0 if the plan doesn't use the PLL, then leave it alone)
+    if (P.pdiv && (PLLFRQ&0x0F)!=P.pdiv) 
+    {
+      TCCR4B=0;  PLLFRQ&=~0x30;  
+      PLLCSR&=~(1<<PLLE);  PLLFRQ=0x40|P.pdiv;  PLLCSR|=(1<<PLLE); 
+      FGReg.tccr4b=0;  FGReg.on=on=0;   // (all of the timer needs writing)
+      SREG=sreg;                        // (interrupts on while it locks,
+      while (!(PLLCSR&(1<<PLOCK))) continue;  //  'applyFromISR' sees it off)
+      cli(); 
+    }
+    r = 0x40 | ((P.pll&3)<<4) | (PLLFRQ&0x0F);   // Input clock we want.
+#else
+    r = 0x4A | ((P.pll&3)<<4);          // PLLFRQ for the input clock we want.
+#endif
+    // With a 'phase' mode load all of the plan at once (continuing the phase
+    // needs the timer running).  The writes below are then all skipped.  
+    if (_Phase==PhaseReset || (_Phase==PhaseContinuous && on)) 
+    {
+      FGPhaseLoad(r,P.enh,cnt,ocr,(P.lg+1)&0xF,_Phase==PhaseReset,k); 
+      FGReg.pllfrq=r;  FGReg.enh=P.enh;  FGReg.top=cnt;  FGReg.ocr=ocr; 
+      FGReg.tccr4b=(P.lg+1)&0xF;  FGReg.dith=0;  on=1; 
+    }
+    // Only write PLLFRQ if it changes (a write can upset the PLL postscaler)
+    if (!on || r!=FGReg.pllfrq) { PLLFRQ=r;  FGReg.pllfrq=r; }  else FGSKIP(); 
+    // Enhanced mode on or off.  (In enhanced mode the OCR4x registers have an
+    // extra LSB that is a half count, and TC4H holds 3 bits)
+    if (!on || P.enh!=FGReg.enh) 
+    {
+      if (P.enh) TCCR4E|=(1<<ENHC4);  else TCCR4E&=~(1<<ENHC4); 
+      FGReg.enh=P.enh; 
+    }
+    else FGSKIP(); 
+    // Now set OCR4C and either OCR4A or OCR4B (cnt and ocr from above)
+    // (If it was dithering the ISR may have left OCR4C one more)
+    if (!on || cnt!=FGReg.top || FGReg.dith) 
+    {
+      TCNT4H /*upper OCR4C*/ =(cnt>>8); OCR4C=(cnt&0xFF); // set counter TOP value
+      FGReg.top=cnt; 
+    }
+    else FGSKIP(); 
+    if (!on || ocr!=FGReg.ocr) 
+    {
+#if FRQGENUSEPB6
+      // Set OCR4b to a value.  set to (1/2 of cnt value)-1 for 50%;  
+      TCNT4H /*upper OCR4B*/ =(ocr>>8); OCR4B=(ocr&0xFF); 
+#else
+      // Set OCR4a- to a value.  set to (1/2 of cnt value)-1 for 50%;  
+      TCNT4H /*upper OCR4A*/ =(ocr>>8); OCR4A=(ocr&0xFF); 
+#endif
+      FGReg.ocr=ocr; 
+    }
+    else FGSKIP(); 
+    FGReg.dith=0; 
+#if FRQGENDITHER
+    // Start dithering if the plan has a fraction.  (Clear any old overflow
+    // flag so the ISR doesn't run on a stale one)
+    if (P.frac) 
+    { 
+      FGDTop=cnt;  FGDFrac=P.frac;  FGDAcc=0;  FGReg.dith=1; 
+      TIFR4=(1<<TOV4);  TIMSK4|=(1<<TOIE4); 
+    }
+#endif
+    // Finally set set prescaler and run 
+    r=(P.lg+1)&0xF; 
+    if (!on || r!=FGReg.tccr4b) { TCCR4B=r;  FGReg.tccr4b=r; }  else FGSKIP(); 
+    FGReg.on=1; 
+    SREG=sreg; 
+#if FRQGENDEBUG
+    FGCYCEND(); 
+    printfROM("apply: %u cycles, %d writes skipped\n",FGCycles,sk); 
+    cnt=OCR4C; cnt=cnt | (TCNT4H<<8);
+    printfROM("PLLFRQ=0x%X, TCCRB=%d, OCRC=%d, Pll=%d, PS=%d, cnt=%d, OCRA=%d\n",
+              PLLFRQ, TCCR4B&0xF, cnt, P.pll,
+              ((unsigned)1)<<((unsigned) ((TCCR4B&0xF)-1)), P.cnt-1,
+              ((OCR4A)|(TCNT4H<<8)) );   
+#endif
+  }
+#endif  // !FRQGENHOST
+  return _FreqGenVal; 
+}
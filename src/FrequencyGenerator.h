@@ -32,9 +32,64 @@
 #ifndef _FREQGEN_H
 #define _FREQGEN_H
 
+#if FRQGENHOST
+#include <stdint.h>         // Host (PC) build of the solver (see .cpp file)
+typedef uint8_t byte;
+#ifndef F_CPU
+#define F_CPU 16000000L
+#endif
+#else
+#include <Arduino.h>
+#endif
+
 class FrequencyGenerator
 {
   public:
+    enum Policy : byte { MinError, MaxCount, LowestPll, KeepPll };
+      // How 'solve' picks between plans with the same (smallest) error: the
+      // first found, the biggest count (least jitter), the slowest clock 
+      // (least power) or the current clock (no PLL change, fastest retune).
+
+    enum Phase : byte { PhaseAny, PhaseContinuous, PhaseReset };
+      // What a change of frequency does to the output phase (see 'phase'): 
+      // the new count takes over at the end of the cycle, the cycle carries on
+      // as far through the new period, or a new cycle starts at once.
+
+    struct Plan
+      // A solved set of Timer4 divisors for one output frequency.  Produced by
+      // 'solve' and written to the hardware by 'apply'.  Plans may be computed 
+      // once (at boot, or by hand) and applied later as often as desired.
+    {
+      byte     pll;     // PLL clock select (PLLTM1:0)  0=16MHz, 2=64MHz, 3=48MHz
+      byte     lg;      // Log2 of the prescaler (prescale = 1<<lg)
+      byte     enh;     // 1 if enhanced mode ('cnt' is in half counts)
+      byte     pdiv;    // PLL frequency select (PDIV3:0) 10=96MHz, 0=PLL not used
+      unsigned cnt;     // Counter value (counts per output cycle)
+      long     freq;    // Output frequency (Hz), 0 if off, -1 if not possible
+      unsigned frac;    // Dither fraction of a count (1/65536ths), 0 if no dither
+    };
+
+    struct Result
+      // The details of a solved frequency (see 'lastResult').
+    {
+      byte     mul;     // PLL multiplier, the Timer4 clock over F_CPU (1, 4 or 
+                        //   3), 0 if not a whole number (FRQGENNOUSB)
+      byte     pllsel;  // PLL clock select (PLLTM1:0)  0=16MHz, 2=64MHz, 3=48MHz
+      byte     pdiv;    // PLL frequency select (PDIV3:0)
+      byte     enh;     // 1 if enhanced mode (OCR4C is in half counts)
+      unsigned long clock;  // Timer4 clock (Hz, calibrated)
+      unsigned ps;      // Prescaler (1 to 16384)
+      unsigned ocr;     // OCR4C value (the count-1)
+      unsigned frac;    // Dither fraction of a count (1/65536ths), 0 if none
+      unsigned long num;  // Exact output frequency (Hz) is num/den 
+      unsigned long den;  //   (for the count, not counting any dither)
+      long     ppb;     // Signed error from the frequency asked for in parts 
+                        //   per billion (ppm*1000), including any dither
+    };
+
+    FrequencyGenerator();
+      // Loads the calibration saved in EEPROM, if any (see 'calibrate').
+
     long set(long Freq);
       // Set Timer4 to the frequency specified by 'Freq' (if 'Freq' > 0), shut off 
       // frequency generator (if 'Freq' is 0) or return current frequency (if 'Freq'
@@ -45,12 +100,329 @@ class FrequencyGenerator
       // crystal clock rate.  
       // Function returns current frequency if ok or -1 if unable to set to the 
       // desired frequency. 
+      // (This is the same as "apply(solve(Freq))").
+
+    long set(long Freq, Phase Ph);
+      // Same as 'set' but with phase mode 'Ph' (see 'phase') for this change.
+
+    long set(long Freq, unsigned Permille);
+      // Same as 'set' but also set the duty cycle (see 'setDuty').
+
+    Plan solve(long Freq);
+      // Calculate the PLL, prescaler and count values that will produce the 
+      // frequency closest to 'Freq' without touching the hardware.  If 'Freq' is
+      // 0 the plan returned turns the generator off.  If no divisors can be found
+      // (or 'Freq' < 0) the plan's 'freq' member is -1.
+
+    Plan solve(long Freq, Policy Pol);
+      // Same as 'solve' but use policy 'Pol' (see 'policy') for this search.
+
+    byte solveTop(long Freq, Plan *Top, byte K);
+      // Set 'Top' to the best 'K' plans for 'Freq' (one for each clock, up to 
+      // FRQGENTOPK, 3), best first, and return how many there are.  This is 
+      // the list the policy picks from.  Doesn't change the output.
+
+    void policy(Policy Pol);
+      // Set the policy 'solve' and 'set' use when more than one plan has the
+      // smallest error (MinError, the first found, by default).  No extra 
+      // search is done; the search keeps its best candidates and the policy 
+      // picks from them.
+
+    Result lastResult();
+      // Return the details of the last 'solve' (or 'set', 'solveMilliHz', 
+      // 'setMilliHz'): PLL multiplier and select, timer clock, prescaler, 
+      // OCR4C count, the exact output frequency as a fraction and the error
+      // in ppb.  All zero if the last frequency was 0 or couldn't be made.
+
+    long apply(const Plan &P);
+      // Write the values in plan 'P' to the Timer4 and PLL registers.  Returns 
+      // the frequency now being output (0 if off) or -1 if 'P' is not a valid 
+      // plan (in which case the hardware is not changed).  Interrupts are off 
+      // while the registers are written (a few dozen cycles).
+
+    long applyFromISR(const Plan &P);
+      // Same as 'apply' but may be called from an interrupt routine (e.g. a 
+      // timer or pin change interrupt) with a plan solved before.  It only 
+      // changes a running output to another frequency: it returns -1 and does
+      // nothing if the output is off, 'P' turns it off or isn't valid, or 
+      // (with FRQGENNOUSB) 'P' needs a new PLL frequency.
 
     long read(); 
       //  Return the current setting of the frequency generator.
 
+    long setMilliHz(long mHz);
+      // Same as 'set' but 'mHz' is the frequency in milli-Hertz (up to 1MHz). 
+      // The divisors are solved against the fractional frequency and the 
+      // function returns the exact frequency now being output in mHz (rounded 
+      // to the nearest mHz), 0 if off or -1 if unable to set the frequency.  
+      // ('mHz' < 0 returns the current frequency in mHz)
+
+    Plan solveMilliHz(long mHz);
+      // Same as 'solve' but 'mHz' is in milli-Hertz (up to 1MHz).  The plan's
+      // 'freq' member is still in Hz (rounded), use 'milliHz' for the exact 
+      // value.
+
+    long milliHz(const Plan &P); 
+      // Return the frequency plan 'P' outputs in mHz (rounded to the nearest 
+      // mHz, 0x7FFFFFFF if over about 2.1MHz), 0 if off or -1 if not valid.
+
+    long readMilliHz(); 
+      // Return the current frequency in mHz. (the same as 'milliHz' of the 
+      // last plan applied)
+
+    void hiRes(bool On);
+      // Turn the high resolution mode on or off (off by default).  When on, 
+      // 'solve' (and 'set') use the Timer4 enhanced compare mode (ENHC4) where
+      // the count has an extra bit and may be a half count.  This halves the 
+      // frequency step, mostly helping at high frequencies where the count is 
+      // small.  Takes effect on the next 'solve' or 'set'.
+
+    void dither(bool On);
+      // Turn dithering on or off (on by default).  Only works if FRQGENDITHER
+      // is defined in the .cpp file.  When on, 'solve' (and 'set') also work
+      // out the fraction of a count left over and a Timer4 overflow interrupt
+      // makes the count one longer on that fraction of the cycles, so the 
+      // average frequency is within a few ppm of the one asked for.  Only 
+      // used up to FRQGENDITHERMAX (F_CPU/256) as the interrupt runs on every 
+      // cycle.  Each cycle is still one of the two nearby frequencies.  Takes 
+      // effect on the next 'solve' or 'set'.
+
+    void setDuty(unsigned Permille);
+      // Set the duty cycle, the part of each cycle the output is high, in 
+      // 1/1000ths (500, 50%, by default, up to 1000).  If the output is on 
+      // the PLL, prescaler and count are kept and only the compare register 
+      // is written (it takes effect at the end of the cycle).  The output is
+      // always high for at least one count and low for at least one, so the 
+      // steps are 1/count of a cycle.  Stays set for later 'set's.
+
+    void setDutyResolution(unsigned Steps);
+      // Have 'solve' and 'set' prefer plans with a count of at least 'Steps' 
+      // (0 by default) so the duty cycle has finer steps, e.g. 1000 for 0.1%.
+      // Of the best plans found (see 'solveTop') the most accurate one with
+      // a big enough count is used (or the one with the biggest count), so
+      // the frequency may be a little less accurate.
+
+    void mute();
+      // Hold the output low without stopping the timer (a few cycles).  The 
+      // plan is kept, 'read' still returns the frequency and 'set' etc. still
+      // work (the output stays muted).  
+
+    void unmute();
+      // Turn the output back on after 'mute'.  The timer kept running, so the
+      // output is in phase with where it would have been.
+
+    void phase(Phase Ph);
+      // Set what a frequency change does to the phase (PhaseAny by default).
+      // PhaseContinuous stops the counter for a moment and scales it to the 
+      // same fraction of the new period, so the output carries on with no 
+      // jump in phase.  PhaseReset restarts the counter, prescaler and output
+      // from the start of a cycle, so the first edge of the new frequency is 
+      // at a known time after the call.  Both load the whole plan at once 
+      // with interrupts off for a few dozen cycles (not at the end of a cycle
+      // as with 'sync').  
+
+    void sync(bool On);
+      // Turn synchronized frequency changes on or off (on by default).  Only
+      // works if FRQGENSYNC is defined in the .cpp file.  When on, and the old 
+      // and new frequencies are both up to FRQGENSYNCMAX (F_CPU/256), 'apply' 
+      // (and 'set' etc.) only stages the new plan and returns.  The Timer4 
+      // overflow interrupt writes its compare values at the start of a cycle
+      // and they load together at its end, so there is no short or long 
+      // cycle.  The new frequency starts within two cycles of the old one.  
+      // Only a plan with the same PLL clock, prescaler and enhanced mode as 
+      // the running one is staged (those take effect as they are written); 
+      // any other change, and turning the output on or off, is done at once
+      // and can make one odd cycle.
+
+    bool pending();
+      // Return true while a plan staged by 'apply' (see 'sync') is waiting to 
+      // be output.  
+
+    void wait();
+      // Wait until a plan staged by 'apply' (see 'sync') is being output.  
+      // Interrupts must be on.
+
+    void calibrate(long Ppb, bool Save=false);
+      // Correct for the crystal: 'Ppb' is how far the 16MHz clock is off in 
+      // parts per billion (ppm*1000), positive if it is fast.  For example, if
+      // 'set(4000000)' measures 4000040Hz, use calibrate(10000).  The solver 
+      // then uses the real clock so the output is what was asked for (to the
+      // limits of the hardware).  If 'Save' the value is also written to 
+      // EEPROM (the 5 bytes at FRQGENEEADDR, the end of the EEPROM by default)
+      // and it is loaded again at startup.  Limited to +/-2%.  Takes effect 
+      // on the next 'solve' or 'set'.  ('plan' and 'nearestExact' still use 
+      // the nominal clock)
+
+    long calibration();
+      // Return the crystal error in ppb (0 if not calibrated).
+
+    long tempComp();
+      // Temperature correction, if FRQGENTEMPCOMP is defined in the .cpp file.
+      // Call often (from loop()); it never waits for the ADC.  Every 
+      // FRQGENTEMPMS (1s) it reads the internal temperature sensor, looks up 
+      // the crystal correction for it in the table in EEPROM (see 
+      // 'tempTable') and adds it to the calibration.  The frequency last set
+      // with 'set', 'setMilliHz' or 'setPeriodNs' is solved again and only 
+      // re-applied if the divisors change.  Returns the correction in ppb.
+      // The ADC is left converting on the 2.56V reference between calls, so
+      // 'analogRead' and an external AREF can't be used with FRQGENTEMPCOMP.
+
+    int temperature();
+      // Return the last temperature sensor reading (raw ADC, about 1 count
+      // per degree C), -1 if none.
+
+    void tempTable(byte N, const unsigned *Adc, const long *Ppb);
+      // Save the temperature table in EEPROM: 'N' (up to 8) points of sensor
+      // reading ('Adc', in increasing order, see 'temperature') and crystal 
+      // correction in ppb ('Ppb', the change from the 'calibrate' value).  
+      // The correction is a straight line between points.  N=0 removes it.
+
+    void pps(bool On);
+      // Start (or stop) the GPS 1PPS disciplined mode, if FRQGENPPS is defined
+      // in the .cpp file (as 1 for ICP1 on Arduino pin 4 using Timer1, or 3 
+      // for ICP3 on pin 13 using Timer3).  The timer counts the crystal and 
+      // the input capture interrupt timestamps each pulse and averages the 
+      // crystal error (over 64 seconds once settled).  While on, that error 
+      // is used instead of the calibration.
+
+    byte ppsUpdate();
+      // Call often (from loop()).  Uses the latest PPS estimate (solving the 
+      // frequency last set again when it has moved by FRQGENPPSSTEP, 10ppb) 
+      // and returns the state: 0 no pulses, 1 averaging, 2 locked (averaged 
+      // for 64 seconds and the last second within 0.5ppm of the average).
+
+    long ppsPpb();
+      // Return the current PPS estimate of the crystal error in ppb.
+
+    static void ppsTimestamp(uint32_t T);
+      // Add a 1PPS timestamp 'T' (in crystal clocks, 32 bits) to the filter.
+      // Called from the capture interrupt.  In a host build (FRQGENHOST) it 
+      // may be called with recorded timestamps to replay them.
+
+    long setPeriodNs(unsigned long Ns);
+      // Set the output period to 'Ns' nanoseconds (0 turns it off).  The 
+      // divisors are chosen to make the period error (not the frequency 
+      // error) smallest.  Returns the period now being output in ns or -1 if
+      // it can't be made (longest is about 1s).
+
+    Plan solvePeriodNs(unsigned long Ns);
+      // Same as 'setPeriodNs' but just returns the plan (like 'solve').
+
+    long periodNs(const Plan &P);
+      // Return the period of plan 'P' in ns, 0 if off or -1 if not valid.
+
+    long readPeriodNs();
+      // Return the current period in ns. (the same as 'periodNs' of the last 
+      // plan applied)
+
+    long stepUp();
+    long stepDown();
+      // Move from the current frequency to the next higher (lower) frequency 
+      // that the hardware can make without a full 'solve'.  This changes the 
+      // count by one or moves to another prescaler or PLL clock at the band 
+      // edges, so stepping never skips a frequency that can be made.  Returns
+      // the new frequency or -1 (and no change) if there isn't one or the 
+      // generator is off.
+
+    unsigned long reachable(long Lo, long Hi, void (*Fn)(const Plan &P));
+      // Call 'Fn' with the plan of every frequency the hardware can make from 
+      // 'Lo' to 'Hi' Hz, in order from lowest to highest with no duplicates, 
+      // and return how many there are ('Fn' may be NULL just to count them). 
+      // The time taken goes with the number of frequencies found, not the 
+      // width of the range.  Doesn't change the output.  Also works in a host
+      // (PC) build (see FRQGENHOST in the .cpp file).
+
+    long nearestExact(long Freq, Plan &P);
+      // Set 'P' to the plan for the frequency closest to 'Freq' that the 
+      // hardware makes exactly (a whole number of Hz with no error) and return
+      // that frequency, -1 if there is none.  For clocks that must be an exact
+      // number of Hz (baud clocks, references).  Doesn't change the output; 
+      // use 'apply(P)' to output it.
+
+    void cacheStats(unsigned long &Hits, unsigned long &Misses);
+      // Return the number of times 'solve' (and 'set', 'solveMilliHz' etc.) 
+      // found the plan in the cache ('Hits') and had to search ('Misses') 
+      // since the last 'cacheClear'.  The cache is only there if FRQGENCACHE 
+      // is defined in the .cpp file (as the number of plans to keep), 
+      // otherwise both are 0.
+
+    void cacheClear();
+      // Empty the plan cache and zero the hit and miss counts.
+
+    template<long F, bool Hi=false> static constexpr Plan plan()
+      // Return the plan for frequency 'F' (in high resolution mode if 'Hi') 
+      // worked out at compile time.  This is the same search as 'solve' (with
+      // the USB clocks and no dithering) so 'apply(plan<F>())' outputs the same 
+      // frequency as 'set(F)' but only costs the register writes, and if 
+      // 'solve' and 'set' aren't used the divide routines aren't linked in.  
+      // A negative frequency or one that can't be made fails the build.  
+      // For example: 
+      //   static const FrequencyGenerator::Plan P1M=FrequencyGenerator::plan<1000000>();
+      //   FG.apply(P1M); 
+    {
+      static_assert(F>=0,"FrequencyGenerator::plan frequency is negative");
+      static_assert(cPlan(F,Hi,cPick(F,Hi,0,255)).freq>=0,
+                    "FrequencyGenerator::plan frequency can't be made");
+      return cPlan(F,Hi,cPick(F,Hi,0,255)); 
+    }
+
   private:
     long _FreqGenVal=0;
+    byte _HiRes=0;
+    byte _Dither=1;
+    byte _Sync=1;
+    byte _Phase=PhaseAny;           // Phase mode (see 'phase')
+    unsigned long _DutyK=32768;     // Part of the cycle OC4x is high (1/65536ths)
+    Plan _Plan={0,0,0,0,0,0,0};     // The last plan applied
+    Plan _Last={0,0,0,0,0,0,0};     // The last plan solved (for 'lastResult')
+    long _LastF=0;                  //   and the frequency asked for
+    byte _LastMilli=0;              //   (in mHz if 1)
+    byte _Policy=MinError;          // Tie break policy for 'solve'
+    long _OutF=0;                   // The frequency last set (for 'retune')
+    byte _OutMode=0;                //   (0 none, 1 Hz, 2 mHz, 3 ns)
+
+    Plan search(long Freq, byte Milli, byte Pol);
+    long step(byte Up);
+    void retune();
+
+    // Compile time solver for 'plan'.  These mirror the search in 'solve' 
+    // with the USB clocks (the pll index selects 16, 64 or 48MHz) and may use
+    // plain divides as they are only ever evaluated by the compiler. 
+    static constexpr unsigned long long cCK(byte pll) 
+      { return F_CPU*(pll==0 ? 1ULL : pll==2 ? 4ULL : 3ULL); }
+    static constexpr byte cBits(unsigned long long n) 
+      { return n ? 1+cBits(n>>1) : 0; }
+    static constexpr unsigned cMax(byte enh) 
+      { return 0x3FF|(enh<<10); }
+    static constexpr unsigned long long cQ(long F, byte pll, byte enh, byte lg)
+      { return (cCK(pll)<<(1+enh))/((unsigned long long)F<<lg); }
+    static constexpr byte cLg0(long F, byte pll) 
+      { return cBits((cCK(pll)>>10)/F); }
+    static constexpr byte cLg(long F, byte pll, byte enh)   // (with the bump)
+      { return cLg0(F,pll)+(cLg0(F,pll)<14 && 
+               (cQ(F,pll,enh,cLg0(F,pll))+1)/2>cMax(enh)); }
+    static constexpr unsigned long long cCnt(long F, byte pll, byte enh)
+      { return (cQ(F,pll,enh,cLg(F,pll,enh))+1)/2; }
+    static constexpr bool cOk(long F, byte pll, byte enh) 
+      { return cLg0(F,pll)<=14 && cCnt(F,pll,enh)>=(4U<<enh) && 
+               cCnt(F,pll,enh)<=cMax(enh); }
+    static constexpr unsigned long long cRem(long F, byte pll, byte enh) 
+      { return (cCK(pll)<<(1+enh))%((unsigned long long)F<<cLg(F,pll,enh)); }
+    static constexpr unsigned long long cDif(long F, byte pll, byte enh) 
+      { return (((cQ(F,pll,enh,cLg(F,pll,enh))&1) ? 
+                 ((unsigned long long)F<<cLg(F,pll,enh))-cRem(F,pll,enh) : 
+                 cRem(F,pll,enh))>>1)/(cCK(pll)/F_CPU); }
+    static constexpr byte cPick(long F, byte enh, byte pll, byte best) 
+      // Return the best pll index from 'pll' on (255 if none)
+      { return (F<=0 || pll>3) ? best : 
+               cPick(F,enh,pll+1+(pll==0),(cOk(F,pll,enh) && (best>3 || 
+                     cDif(F,pll,enh)<cDif(F,best,enh))) ? pll : best); }
+    static constexpr Plan cPlan(long F, byte enh, byte pll) 
+      { return (F==0) ? Plan{0,0,enh,0xA,0,0L,0} : 
+               (pll>3) ? Plan{0,0,enh,0xA,0,-1L,0} : 
+               Plan{pll,cLg(F,pll,enh),enh,0xA,(unsigned)cCnt(F,pll,enh),
+                    (long)((((cCK(pll)<<(1+enh))/((1ULL<<cLg(F,pll,enh))*
+                             cCnt(F,pll,enh)))+1)/2),0}; }
 //    int _pin;
 };
 